@@ -0,0 +1,356 @@
+// Benchmarks of the bridge through the C API of pythonodejs.h, built with
+// `scons bench` and usually run through bench/bench.py.
+//
+// Every benchmark warms up, then times each operation on its own with a
+// steady clock and reports ops/s, p50/p99 latency and the C++ heap
+// allocations made per operation. Allocations are counted by replacing the
+// global operator new of the process, which the library and libnode also go
+// through. malloc calls from C code (libuv) and the JS heap are not counted.
+#include "pythonodejs.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+static std::atomic<uint64_t> allocations{0};
+static std::atomic<uint64_t> allocated_bytes{0};
+
+// Kept out of line, or GCC sees memory from malloc() go to operator delete
+// and memory from operator new go to free().
+__attribute__((noinline)) void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void *data = std::malloc(size != 0 ? size : 1)) {
+        return data;
+    }
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void *data) noexcept {
+    std::free(data);
+}
+__attribute__((noinline)) void operator delete(void *data, size_t) noexcept {
+    std::free(data);
+}
+
+using Clock = std::chrono::steady_clock;
+
+struct Options {
+    double scale = 1.0;
+    const char *filter = nullptr;
+    bool json = false;
+};
+
+struct Result {
+    std::string name;
+    size_t ops;
+    double ops_per_sec;
+    double p50_ns;
+    double p99_ns;
+    double allocs_per_op;
+    double bytes_per_op;
+};
+
+static Options options;
+static std::vector<Result> results;
+
+static uint64_t elapsed_ns(Clock::time_point start, Clock::time_point end) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start)
+        .count();
+}
+
+// Runs `op` a tenth of `iterations` times to warm up, then `iterations`
+// times (scaled by --scale), each timed on its own. Returns false if the
+// benchmark was filtered out.
+template <typename Op>
+static bool measure(const std::string &name, size_t iterations, Op op) {
+    if (options.filter != nullptr &&
+        name.find(options.filter) == std::string::npos) {
+        return false;
+    }
+    iterations = std::max<size_t>(1, iterations * options.scale);
+    for (size_t i = 0; i < std::max<size_t>(1, iterations / 10); i++) {
+        op();
+    }
+
+    std::vector<uint64_t> samples(iterations);
+    uint64_t allocs = allocations.load(std::memory_order_relaxed);
+    uint64_t bytes = allocated_bytes.load(std::memory_order_relaxed);
+    Clock::time_point start = Clock::now();
+    for (size_t i = 0; i < iterations; i++) {
+        Clock::time_point op_start = Clock::now();
+        op();
+        samples[i] = elapsed_ns(op_start, Clock::now());
+    }
+    uint64_t total_ns = elapsed_ns(start, Clock::now());
+    allocs = allocations.load(std::memory_order_relaxed) - allocs;
+    bytes = allocated_bytes.load(std::memory_order_relaxed) - bytes;
+
+    std::sort(samples.begin(), samples.end());
+    Result result;
+    result.name = name;
+    result.ops = iterations;
+    result.ops_per_sec = iterations * 1e9 / std::max<uint64_t>(total_ns, 1);
+    result.p50_ns = samples[iterations / 2];
+    result.p99_ns = samples[std::min(iterations - 1, iterations * 99 / 100)];
+    result.allocs_per_op = static_cast<double>(allocs) / iterations;
+    result.bytes_per_op = static_cast<double>(bytes) / iterations;
+    if (!options.json) {
+        printf("%-28s %12.0f ops/s  p50 %10.0f ns  p99 %10.0f ns  "
+               "%8.1f allocs/op  %10.0f B/op\n",
+               name.c_str(), result.ops_per_sec, result.p50_ns, result.p99_ns,
+               result.allocs_per_op, result.bytes_per_op);
+        fflush(stdout);
+    }
+    results.push_back(result);
+    return true;
+}
+
+static int callbacks = 0;
+static int settled = 0;
+static std::vector<int64_t> settled_ids; // released after each call
+static NodeValue callback_result = {
+    .type = NUMBER, .subtype = 0, .length = 0, .val_num = 2};
+
+static void *bench_callback(const char *, const NodeValue *, int) {
+    callbacks++;
+    return &callback_result;
+}
+
+static void bench_future_callback(NodeResult *result) {
+    settled += result->value.length / 2;
+    for (uint32_t i = 0; i < result->value.length; i += 2) {
+        settled_ids.push_back(result->value.val_children[i].val_int);
+    }
+    Node_Release_Result(result);
+}
+
+static NodeContext *new_context() {
+    static char arg0[] = "node";
+    static char *argv[] = {arg0, nullptr};
+    NodeContext *context = NodeContext_Create();
+    NodeContext_SetCallback(context, bench_callback);
+    NodeContext_SetFutureCallback(context, bench_future_callback);
+    if (NodeContext_Setup(context, 1, argv) != 0 ||
+        NodeContext_Init(context, nullptr, 0, 0) != 0) {
+        std::cerr << "PYTHONODEJS: Failed to start a context." << std::endl;
+        exit(1);
+    }
+    return context;
+}
+
+static void free_context(NodeContext *context) {
+    NodeContext_Dispose(context);
+    NodeContext_Destroy(context);
+}
+
+// Runs setup code whose result is not needed.
+static void run(NodeContext *context, const char *code) {
+    NodeResult *result = NodeContext_Run_Script(context, code);
+    if (result->value.type == ERROR_T) {
+        std::cerr << "PYTHONODEJS: Benchmark setup failed: " << code
+                  << std::endl;
+        exit(1);
+    }
+    Node_Release_Result(result);
+}
+
+static NodeValue function(NodeContext *context, const char *code) {
+    NodeResult *result = NodeContext_Run_Script(context, code);
+    NodeValue value = result->value;
+    Node_Release_Result(result);
+    if (value.type != FUNCTION) {
+        std::cerr << "PYTHONODEJS: Not a function: " << code << std::endl;
+        exit(1);
+    }
+    return value;
+}
+
+static void release_handle(NodeContext *context, const NodeValue &value) {
+    NodeContext_Release_Handles(context, &value.val_ref, 1);
+}
+
+static NodeResult *call(NodeContext *context, NodeValue function,
+                        NodeValue *args = nullptr, size_t args_length = 0) {
+    return NodeContext_Call_Function(context, function, args, args_length);
+}
+
+// Source of about `size` bytes. The leading comment is rewritten before each
+// run, which keeps V8 from reusing the compilation of the previous one.
+static std::string script_source(size_t size) {
+    std::string source = "/*00000000*/ (function () {\n  let a = 0;\n";
+    for (int i = 0; source.size() < size; i++) {
+        source += "  a += " + std::to_string(i) + " * a + 1;\n";
+    }
+    return source + "  return a;\n})()";
+}
+
+static void bench_startup() {
+    measure("startup", 10, [] { free_context(new_context()); });
+}
+
+static void bench_scripts(NodeContext *context) {
+    for (auto [name, size, iterations] :
+         {std::make_tuple("run_script/small", 64, 2000),
+          std::make_tuple("run_script/large", 1 << 20, 20)}) {
+        std::string source = script_source(size);
+        int runs = 0;
+        measure(name, iterations, [&] {
+            char digits[9];
+            snprintf(digits, sizeof(digits), "%08x", runs++);
+            memcpy(&source[2], digits, 8);
+            Node_Release_Result(
+                NodeContext_Run_Script(context, source.c_str()));
+        });
+    }
+}
+
+static void bench_calls(NodeContext *context) {
+    NodeValue add = function(context, "(a, b) => a + b");
+    NodeValue args[] = {
+        {.type = NUMBER, .subtype = 0, .length = 0, .val_num = 1},
+        {.type = NUMBER, .subtype = 0, .length = 0, .val_num = 2}};
+    measure("call/round_trip", 100000,
+            [&] { Node_Release_Result(call(context, add, args, 2)); });
+    release_handle(context, add);
+
+    NodeValue callback = NodeContext_Create_Function(context, "bench");
+    const char *keys[] = {"bench"};
+    NodeContext_Define_Global(context, keys, &callback, 1);
+    NodeValue call_back = function(context, "() => bench(1)");
+    callbacks = 0;
+    if (measure("callback/round_trip", 100000,
+                [&] { Node_Release_Result(call(context, call_back)); }) &&
+        callbacks == 0) {
+        std::cerr << "PYTHONODEJS: The callback was never called."
+                  << std::endl;
+    }
+    release_handle(context, call_back);
+    release_handle(context, callback);
+
+    // Settlements are delivered at the end of the call that made them.
+    NodeValue resolve = function(context, "() => Promise.resolve(1)");
+    settled = 0;
+    if (measure("promise/settle", 20000,
+                [&] {
+                    Node_Release_Result(call(context, resolve));
+                    NodeContext_Release_Futures(
+                        context, settled_ids.data(),
+                        static_cast<int>(settled_ids.size()));
+                    settled_ids.clear();
+                }) &&
+        settled == 0) {
+        std::cerr << "PYTHONODEJS: No promise was settled." << std::endl;
+    }
+    release_handle(context, resolve);
+}
+
+// Representative payloads, converted from JS (to_c) and back (to_js).
+static void bench_conversions(NodeContext *context) {
+    run(context, R"(globalThis.benchShapes = {
+        numbers: Array.from({ length: 100000 }, (_, i) => i * 0.5),
+        records: Array.from({ length: 10000 }, (_, i) => ({
+            id: i, name: 'user' + i, score: i / 7, active: i % 2 === 0,
+        })),
+        string: 'x'.repeat(1 << 20),
+        typed: new Float64Array(1 << 17),
+        deep: (() => {
+            let node = { depth: 0 };
+            for (let i = 1; i < 200; i++) node = { depth: i, child: node };
+            return node;
+        })(),
+    })");
+    NodeValue sink = function(context, "(value) => undefined");
+
+    for (auto [shape, iterations] :
+         {std::make_pair("numbers", 200), std::make_pair("records", 100),
+          std::make_pair("string", 500), std::make_pair("typed", 20000),
+          std::make_pair("deep", 20000)}) {
+        std::string getter = std::string("() => benchShapes.") + shape;
+        NodeValue get = function(context, getter.c_str());
+        std::string name = std::string("convert/") + shape;
+        measure(name + "/to_c", iterations, [&] {
+            NodeResult *result = call(context, get);
+            if (result->value.type == TYPED_ARRAY) {
+                release_handle(context, result->value);
+            }
+            Node_Release_Result(result);
+        });
+
+        // Typed arrays come from JS as handles and go to JS as memory lent
+        // to V8, everything else is passed back as it came.
+        NodeResult *value = call(context, get);
+        std::vector<double> typed(1 << 17);
+        NodeValue arg = value->value;
+        if (arg.type == TYPED_ARRAY) {
+            release_handle(context, arg);
+            arg = {.type = TYPED_ARRAY,
+                   .subtype = FLOAT64_T,
+                   .length = static_cast<uint32_t>(typed.size() *
+                                                   sizeof(double)),
+                   .val_ptr = typed.data()};
+        }
+        measure(name + "/to_js", iterations, [&] {
+            Node_Release_Result(call(context, sink, &arg, 1));
+            void *released[16];
+            NodeContext_Drain_Released(context, released, 16);
+        });
+        Node_Release_Result(value);
+        release_handle(context, get);
+    }
+    release_handle(context, sink);
+    run(context, "delete globalThis.benchShapes");
+}
+
+static void print_json() {
+    printf("[\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const Result &result = results[i];
+        printf("  {\"name\": \"%s\", \"ops\": %zu, \"ops_per_sec\": %.1f, "
+               "\"p50_ns\": %.0f, \"p99_ns\": %.0f, \"allocs_per_op\": %.2f, "
+               "\"bytes_per_op\": %.1f}%s\n",
+               result.name.c_str(), result.ops, result.ops_per_sec,
+               result.p50_ns, result.p99_ns, result.allocs_per_op,
+               result.bytes_per_op, i + 1 < results.size() ? "," : "");
+    }
+    printf("]\n");
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            options.json = true;
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            options.scale = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--json] [--scale FACTOR] [--filter NAME]"
+                      << std::endl;
+            return 2;
+        }
+    }
+
+    bench_startup();
+    NodeContext *context = new_context();
+    bench_scripts(context);
+    bench_calls(context);
+    bench_conversions(context);
+    free_context(context);
+    Node_Shutdown();
+
+    if (options.json) {
+        print_json();
+    }
+    return 0;
+}
@@ -0,0 +1,89 @@
+"""
+Runs the native benchmarks built by `scons bench` and compares them with a
+saved baseline, e.g. before and after upgrading libnode:
+
+    python bench/bench.py --save before.json
+    python bench/bench.py --compare before.json
+"""
+
+from pathlib import Path
+
+import argparse
+import json
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+
+ROOT = Path(__file__).resolve().parent.parent
+BINARY = ROOT / "build" / "pythonodejs-bench"
+FIELDS = ("ops_per_sec", "p50_ns", "p99_ns", "allocs_per_op", "bytes_per_op")
+
+
+def run(binary: Path, scale: float, filter: str, cpus: str) -> list:
+    command = [str(binary), "--json", "--scale", str(scale)]
+    if filter:
+        command += ["--filter", filter]
+    if cpus:
+        if platform.system() != "Linux" or shutil.which("taskset") is None:
+            sys.exit("--cpus needs taskset (Linux)")
+        command = ["taskset", "--cpu-list", cpus] + command
+    output = subprocess.run(command, check=True, stdout=subprocess.PIPE, text=True)
+    return json.loads(output.stdout)
+
+
+def median_of(runs: list) -> dict:
+    """Median of every field over the runs, by benchmark name."""
+    results = {}
+    for result in runs[0]:
+        samples = [r for run in runs for r in run if r["name"] == result["name"]]
+        results[result["name"]] = {
+            field: statistics.median(s[field] for s in samples) for field in FIELDS
+        }
+    return results
+
+
+def print_results(results: dict, baseline: dict = None):
+    print(
+        f"{'benchmark':<28} {'ops/s':>12} {'p50 ns':>10} {'p99 ns':>10}"
+        f" {'allocs/op':>10} {'B/op':>10}"
+        + (f" {'ops/s vs base':>14}" if baseline else "")
+    )
+    for name, result in results.items():
+        line = (
+            f"{name:<28} {result['ops_per_sec']:>12.0f}"
+            f" {result['p50_ns']:>10.0f} {result['p99_ns']:>10.0f}"
+            f" {result['allocs_per_op']:>10.1f} {result['bytes_per_op']:>10.0f}"
+        )
+        if baseline and name in baseline:
+            change = result["ops_per_sec"] / baseline[name]["ops_per_sec"] - 1
+            line += f" {change:>+13.1%}"
+        print(line)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Runs the native benchmarks.")
+    parser.add_argument("--binary", type=Path, default=BINARY)
+    parser.add_argument("--scale", type=float, default=1.0, help="iterations factor")
+    parser.add_argument("--filter", help="only benchmarks whose name contains this")
+    parser.add_argument("--repeat", type=int, default=3, help="runs, medians kept")
+    parser.add_argument("--cpus", help="CPU list to pin to, e.g. 2-3 (Linux)")
+    parser.add_argument("--save", type=Path, help="write the results as JSON")
+    parser.add_argument("--compare", type=Path, help="baseline saved with --save")
+    args = parser.parse_args()
+
+    if not args.binary.exists():
+        sys.exit(f"{args.binary} not found, build it with `scons bench`")
+    runs = [
+        run(args.binary, args.scale, args.filter, args.cpus) for _ in range(args.repeat)
+    ]
+    results = median_of(runs)
+    baseline = json.loads(args.compare.read_text()) if args.compare else None
+    print_results(results, baseline)
+    if args.save:
+        args.save.write_text(json.dumps(results, indent=2))
+
+
+if __name__ == "__main__":
+    main()
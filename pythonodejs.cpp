@@ -1,17 +1,39 @@
 #include "pythonodejs.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cstdint>
 #include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <random>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#ifndef _WIN32
+#include <poll.h>
+#endif
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "cppgc/platform.h"
 #include "env.h"
 #include "node.h"
 #include "node_internals.h"
 #include "uv.h"
+#include "v8-profiler.h"
 
 using node::CommonEnvironmentSetup;
 using node::Environment;
@@ -23,8 +45,266 @@ using v8::Locker;
 using v8::V8;
 using v8::Value;
 
+// Work submitted to the JS thread by NodeContext_Post_*.
+struct Command {
+    enum Kind {
+        SCRIPT,
+        CALL,
+        CONSTRUCT,
+        MAP,
+        DEFINE,
+        PROFILE_START,
+        PROFILE_STOP
+    };
+
+    std::atomic<Command *> next{nullptr};
+    Kind kind;
+    int64_t id;
+    std::string code; // .cpuprofile path for PROFILE_STOP
+    NodeValue function;
+    NodeValue *args;   // rows for MAP, values to define for DEFINE
+    size_t args_length;
+    int transfer = TRANSFER_TREE; // SCRIPT and CALL
+    const char **keys; // DEFINE only
+    int sampling_interval = 0; // PROFILE_START only
+    std::string collapsed_path; // PROFILE_STOP only, empty for none
+};
+
+// Intrusive multi-producer single-consumer queue (Vyukov). Producers never
+// block each other, push is a single atomic exchange.
+struct CommandQueue {
+    Command stub;
+    std::atomic<Command *> head{&stub};
+    Command *tail = &stub; // consumer only
+
+    void push(Command *command) {
+        command->next.store(nullptr, std::memory_order_relaxed);
+        Command *prev = head.exchange(command, std::memory_order_acq_rel);
+        prev->next.store(command, std::memory_order_release);
+    }
+
+    // Returns nullptr when empty, or while a push is half done.
+    Command *pop() {
+        Command *first = tail;
+        Command *next = first->next.load(std::memory_order_acquire);
+        if (first == &stub) {
+            if (next == nullptr) {
+                return nullptr;
+            }
+            tail = next;
+            first = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        if (first != head.load(std::memory_order_acquire)) {
+            return nullptr;
+        }
+        push(&stub);
+        next = first->next.load(std::memory_order_acquire);
+        if (next != nullptr) {
+            tail = next;
+            return first;
+        }
+        return nullptr;
+    }
+};
+
+// Object keys interned by a context, numbered from 1. Record-shaped data
+// repeats the same few keys, each is converted to UTF-8 and created in V8
+// once and then referred to by id in NodeValue::subtype. Keys are never
+// evicted, the table stops growing once ids run out.
+struct KeyTable {
+    static constexpr size_t kMaxKeys = UINT16_MAX;
+
+    std::deque<std::string> names; // id - 1 -> UTF-8, never moves
+    std::vector<v8::Global<v8::String>> strings; // id - 1 -> V8 string
+    std::unordered_map<std::string_view, uint16_t> ids;
+    std::unordered_multimap<int, uint16_t> hashes; // identity hash -> id
+
+    bool full() const { return names.size() >= kMaxKeys; }
+
+    uint16_t add(Isolate *isolate, v8::Local<v8::String> str,
+                 std::string name) {
+        names.push_back(std::move(name));
+        strings.emplace_back(isolate, str);
+        uint16_t id = static_cast<uint16_t>(names.size());
+        ids.emplace(names.back(), id);
+        hashes.emplace(str->GetIdentityHash(), id);
+        return id;
+    }
+
+    void clear() {
+        hashes.clear();
+        ids.clear();
+        strings.clear();
+        names.clear();
+    }
+};
+
+// Promises bridged in either direction. JS promises get sequential ids,
+// reused once Python released them after their settlement was delivered, and
+// are observed through one cached JS function. Settlements are queued in a
+// single arena and handed to the future callback together, once per event
+// loop iteration.
+struct FutureTable {
+    std::vector<int64_t> free_ids;
+    int64_t next_id = 0;
+    std::mutex released_mutex;
+    std::vector<int64_t> released; // by Python, from any thread
+    v8::Global<v8::Function> bridge; // (promise, id) => undefined
+    NodeResult *settled = nullptr;
+    std::vector<NodeValue> settled_values; // PROMISE header, value, ...
+    uv_check_t check;
+    bool check_open = false;
+    // Resolvers of Python futures, indexed by the id Python gave them.
+    std::vector<v8::Global<v8::Promise::Resolver>> resolvers;
+
+    int64_t acquire() {
+        if (free_ids.empty()) {
+            std::lock_guard<std::mutex> lock(released_mutex);
+            free_ids.swap(released);
+        }
+        if (free_ids.empty()) {
+            return next_id++;
+        }
+        int64_t id = free_ids.back();
+        free_ids.pop_back();
+        return id;
+    }
+};
+
+// Functions, symbols, lazy objects and buffers referenced from Python. Refs
+// are generation << 32 | (index + 1), slots are reused and a ref that
+// outlived its slot is detected instead of reaching freed handles. Python
+// releases refs from any thread, they are freed in batches on the next turn
+// of the context, under the isolate lock.
+struct HandleTable {
+    struct Slot {
+        v8::Global<v8::Value> value;
+        v8::Global<v8::Value> recv; // `this` for methods read off an object
+        std::string name;           // function name or symbol description
+        // Buffers: the store stays alive as long as the handle does, even if
+        // JS drops the buffer.
+        std::shared_ptr<v8::BackingStore> store;
+        void *data = nullptr;
+        size_t byte_length = 0;
+        uint32_t generation = 0;
+        bool live = false;
+    };
+
+    std::deque<Slot> slots; // never moves
+    std::vector<uint32_t> free_slots;
+    uint64_t created = 0;
+    uint64_t released = 0;
+    uint64_t stale = 0;
+    std::mutex pending_mutex;
+    std::vector<uint64_t> pending;
+
+    uint64_t add(Slot **out) {
+        uint32_t index;
+        if (free_slots.empty()) {
+            index = static_cast<uint32_t>(slots.size());
+            slots.emplace_back();
+        } else {
+            index = free_slots.back();
+            free_slots.pop_back();
+        }
+        Slot &slot = slots[index];
+        slot.live = true;
+        created++;
+        *out = &slot;
+        return static_cast<uint64_t>(slot.generation) << 32 | (index + 1);
+    }
+
+    Slot *get(uint64_t ref) {
+        uint32_t index = static_cast<uint32_t>(ref) - 1;
+        if (index >= slots.size()) {
+            return nullptr;
+        }
+        Slot &slot = slots[index];
+        if (!slot.live || slot.generation != ref >> 32) {
+            return nullptr;
+        }
+        return &slot;
+    }
+
+    void release(uint64_t ref) {
+        Slot *slot = get(ref);
+        if (slot == nullptr) {
+            stale++;
+            return;
+        }
+        slot->value.Reset();
+        slot->recv.Reset();
+        slot->name.clear();
+        slot->store.reset();
+        slot->data = nullptr;
+        slot->byte_length = 0;
+        slot->live = false;
+        slot->generation++;
+        free_slots.push_back(static_cast<uint32_t>(ref) - 1);
+        released++;
+    }
+
+    // Frees what Python released since the last turn.
+    void collect() {
+        std::vector<uint64_t> refs;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            refs.swap(pending);
+        }
+        for (uint64_t ref : refs) {
+            release(ref);
+        }
+    }
+};
+
+// Per-site histograms of bridge call phases, see NodeContext_Timing_Enable.
+// Sites are looked up by string_view, recording allocates only the first
+// time a site is seen.
+struct TimingTable {
+    struct Histogram {
+        uint64_t count = 0;
+        uint64_t total_ns = 0;
+        uint64_t max_ns = 0;
+        uint64_t buckets[TIMING_BUCKETS] = {};
+
+        void add(uint64_t ns) {
+            count++;
+            total_ns += ns;
+            max_ns = std::max(max_ns, ns);
+            int bucket = ns != 0 ? std::bit_width(ns) - 1 : 0;
+            buckets[std::min(bucket, TIMING_BUCKETS - 1)]++;
+        }
+    };
+    using Site = std::array<Histogram, TIMING_PHASES>;
+
+    // Recorded from the thread running JS and from Python threads.
+    std::mutex mutex;
+    std::map<std::string, Site, std::less<>> sites[TIMING_KINDS];
+
+    Site &site(int kind, std::string_view name) {
+        size_t length = sizeof(NodeTimingHistogram::site) - 1;
+        if (name.size() > length) {
+            // Cut before a UTF-8 character, not inside one.
+            while (length > 0 && (name[length] & 0xC0) == 0x80) {
+                length--;
+            }
+            name = name.substr(0, length);
+        }
+        auto it = sites[kind].find(name);
+        if (it == sites[kind].end()) {
+            it = sites[kind].emplace(std::string(name), Site()).first;
+        }
+        return it->second;
+    }
+};
+
 struct NodeContext {
-    std::unique_ptr<MultiIsolatePlatform> platform;
+    MultiIsolatePlatform *platform; // shared by all contexts
     std::vector<std::string> args;
     std::vector<std::string> exec_args;
     std::unique_ptr<CommonEnvironmentSetup> setup;
@@ -35,31 +315,166 @@ struct NodeContext {
     Callback py_callback;
     FutureCallback future_callback;
     uv_loop_t *loop;
-    std::unordered_map<int64_t, v8::Global<v8::Promise::Resolver>>
-        resolvers_from_python;
-    std::unordered_map<int64_t, v8::Global<v8::Promise::Resolver>>
-        resolvers_to_python;
+    FutureTable futures;
+    HandleTable handles;
+    std::atomic<bool> timing_enabled{false};
+    TimingTable timing;
+    bool lazy = false;
+    bool nonblocking = false; // see NodeContext_SetNonBlocking
+    KeyTable keys;
+    // Dedicated JS thread, see NodeContext_Start_Thread.
+    std::thread js_thread;
+    std::atomic<bool> thread_stopping{false};
+    // Whether posts are accepted, and how many are between that check and
+    // their wakeup. Stop_Thread waits for those before closing `wakeup`.
+    std::atomic<bool> thread_running{false};
+    std::atomic<int> posting{0};
+    uv_async_t wakeup;
+    CommandQueue commands;
+    CompletionCallback completion_callback;
+    // On-disk V8 code cache, disabled when the directory is empty.
+    std::filesystem::path code_cache_dir;
+    uint64_t code_cache_limit = 0;
+    std::unordered_set<uint64_t> code_cache_seen; // compiled in this isolate
+    // Startup snapshot, must outlive the isolate created from it.
+    std::string snapshot_path;
+    node::EmbedderSnapshotData::Pointer snapshot;
+    // Python buffers V8 is done with, returned by NodeContext_Drain_Released.
+    // Backing stores may be freed off the JS thread, hence the lock.
+    std::mutex released_mutex;
+    std::vector<void *> released;
+    // CPU profile being recorded, see NodeContext_Profile_Start.
+    v8::CpuProfiler *profiler = nullptr;
+    v8::ProfilerId profile_id = 0;
+    bool profiling = false;
+    bool heap_sampling = false;        // see NodeContext_Heap_Sampling_Start
+    bool embedder_graph_added = false; // see NodeContext_Heap_Snapshot
 };
 
-struct FuncInfo {
-    const char *name;
+// Stopwatch over the phases of one bridge call. Does nothing but test a
+// flag when timing is off.
+struct CallTiming {
     NodeContext *context;
+    uint64_t last = 0;
+    uint64_t phases[TIMING_PHASES] = {};
+    unsigned seen = 0;
+
+    explicit CallTiming(NodeContext *context)
+        : context(context->timing_enabled.load(std::memory_order_relaxed)
+                      ? context
+                      : nullptr) {
+        if (this->context != nullptr) {
+            last = uv_hrtime();
+        }
+    }
+
+    // Ends `phase`, which started where the previous one ended.
+    void lap(int phase) {
+        if (context == nullptr) {
+            return;
+        }
+        uint64_t now = uv_hrtime();
+        phases[phase] += now - last;
+        seen |= 1u << phase;
+        last = now;
+    }
+
+    void record(int kind, std::string_view site) {
+        if (context == nullptr) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(context->timing.mutex);
+        TimingTable::Site &histograms = context->timing.site(kind, site);
+        for (int phase = 0; phase < TIMING_PHASES; phase++) {
+            if (seen & (1u << phase)) {
+                histograms[phase].add(phases[phase]);
+            }
+        }
+    }
 };
 
-struct FutureInfo {
+struct FuncInfo {
+    const char *name;
     NodeContext *context;
-    int64_t id;
-    bool rejected;
 };
 
-struct Func {
-    v8::Global<v8::Function> function;
-};
+// Bump allocator owning the out-of-line storage (strings, children) of one
+// converted value tree, released in a single operation.
+struct NodeArena {
+    static constexpr size_t kMinBlock = 4096;
+    static constexpr size_t kMaxBlock = 1 << 20;
+
+    struct Block {
+        Block *next;
+        size_t size;
+        size_t used;
+    };
+
+    // Bytes of all arenas, and results not released yet, in the process.
+    static inline std::atomic<uint64_t> live_bytes{0};
+    static inline std::atomic<uint64_t> live_results{0};
+
+    Block *head = nullptr;
+    size_t next_size = kMinBlock;
+
+    NodeArena() = default;
+    NodeArena(const NodeArena &) = delete;
+    NodeArena &operator=(const NodeArena &) = delete;
+
+    ~NodeArena() {
+        while (head != nullptr) {
+            Block *next = head->next;
+            live_bytes.fetch_sub(head->size, std::memory_order_relaxed);
+            free(head);
+            head = next;
+        }
+    }
+
+    void *alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+        if (head != nullptr) {
+            void *p = bump(head, size, align);
+            if (p != nullptr) {
+                return p;
+            }
+        }
+        size_t block_size = std::max(next_size, size + align);
+        next_size = std::min(next_size * 2, kMaxBlock);
+        Block *block = static_cast<Block *>(malloc(sizeof(Block) + block_size));
+        block->next = head;
+        block->size = block_size;
+        block->used = 0;
+        head = block;
+        live_bytes.fetch_add(block_size, std::memory_order_relaxed);
+        return bump(block, size, align);
+    }
+
+    NodeValue *values(size_t count) {
+        void *p = alloc(count * sizeof(NodeValue), alignof(NodeValue));
+        memset(p, 0, count * sizeof(NodeValue));
+        return static_cast<NodeValue *>(p);
+    }
 
-struct Val {
-    v8::Global<v8::Value> value;
+  private:
+    static void *bump(Block *block, size_t size, size_t align) {
+        uintptr_t base = reinterpret_cast<uintptr_t>(block + 1);
+        uintptr_t p =
+            (base + block->used + align - 1) & ~(uintptr_t)(align - 1);
+        if (p + size > base + block->size) {
+            return nullptr;
+        }
+        block->used = p + size - base;
+        return reinterpret_cast<void *>(p);
+    }
 };
 
+static NodeResult *new_result() {
+    NodeArena *arena = new NodeArena();
+    NodeArena::live_results.fetch_add(1, std::memory_order_relaxed);
+    NodeResult *result = new (arena->alloc(sizeof(NodeResult)))
+        NodeResult{.value = {}, .arena = arena};
+    return result;
+}
+
 int64_t randomInt64() {
     static std::random_device rd;
     static std::mt19937_64 gen(rd());
@@ -104,6 +519,30 @@ void debugValue(v8::Local<v8::Value> value, v8::Isolate *isolate,
     }
 }
 
+// Hands the promises settled so far to the future callback. Their ids stay
+// taken until Python releases them with NodeContext_Release_Futures, a
+// promise may settle before Python got the result holding it.
+static void deliver_futures(NodeContext *context) {
+    FutureTable &futures = context->futures;
+    NodeResult *settled = futures.settled;
+    if (settled == nullptr) {
+        return;
+    }
+    futures.settled = nullptr;
+    std::vector<NodeValue> values;
+    values.swap(futures.settled_values);
+    NodeValue *items = settled->arena->values(values.size());
+    std::copy(values.begin(), values.end(), items);
+    settled->value = {.type = ARRAY,
+                      .length = static_cast<uint32_t>(values.size()),
+                      .val_children = items};
+    if (context->future_callback) {
+        context->future_callback(settled);
+    } else {
+        Node_Release_Result(settled);
+    }
+}
+
 void run_loop_blocking(NodeContext *context) {
     while (uv_loop_alive(context->loop)) {
         uv_run(context->loop, UV_RUN_DEFAULT);
@@ -119,42 +558,362 @@ void run_loop_blocking(NodeContext *context) {
     node::EmitExit(context->env);
 }
 
+// Lets pending JS work progress after a bridge call. In non-blocking mode the
+// embedder drives the loop with NodeContext_Tick, so only what is already due
+// runs here and the call returns without waiting for timers or I/O.
+void run_loop(NodeContext *context) {
+    if (context->nonblocking) {
+        uv_run(context->loop, UV_RUN_NOWAIT);
+    } else {
+        run_loop_blocking(context);
+    }
+    deliver_futures(context);
+    context->handles.collect();
+}
+
 NodeContext *NodeContext_Create() { return new NodeContext(); }
 
 void NodeContext_Destroy(NodeContext *context) { delete context; }
 
-int NodeContext_Setup(NodeContext *context, int argc, char **argv) {
-    argv = uv_setup_args(argc, argv);
-    std::vector<std::string> args(argv, argv + argc);
+// Counters shared by CountingPlatform and the tasks it wraps.
+struct PlatformCounters {
+    std::atomic<uint64_t> queued{0};
+    std::atomic<uint64_t> running{0};
+    std::atomic<uint64_t> completed{0};
+    std::atomic<uint64_t> jobs_running{0};
+};
+
+class CountedTask : public v8::Task {
+  public:
+    CountedTask(std::unique_ptr<v8::Task> task, PlatformCounters &counters)
+        : task(std::move(task)), counters(counters) {
+        counters.queued++;
+    }
+
+    ~CountedTask() override {
+        // Dropped without running, e.g. when the platform shuts down.
+        if (task) {
+            counters.queued--;
+        }
+    }
+
+    void Run() override {
+        std::unique_ptr<v8::Task> task = std::move(this->task);
+        counters.queued--;
+        counters.running++;
+        task->Run();
+        counters.running--;
+        counters.completed++;
+    }
+
+  private:
+    std::unique_ptr<v8::Task> task;
+    PlatformCounters &counters;
+};
+
+class CountedJobTask : public v8::JobTask {
+  public:
+    CountedJobTask(std::unique_ptr<v8::JobTask> task,
+                   PlatformCounters &counters)
+        : task(std::move(task)), counters(counters) {}
+
+    void Run(v8::JobDelegate *delegate) override {
+        counters.jobs_running++;
+        task->Run(delegate);
+        counters.jobs_running--;
+    }
+
+    size_t GetMaxConcurrency(size_t worker_count) const override {
+        return task->GetMaxConcurrency(worker_count);
+    }
+
+  private:
+    std::unique_ptr<v8::JobTask> task;
+    PlatformCounters &counters;
+};
+
+// Node's platform with its worker tasks and jobs counted, everything else is
+// forwarded as is.
+class CountingPlatform : public MultiIsolatePlatform {
+  public:
+    explicit CountingPlatform(std::unique_ptr<MultiIsolatePlatform> platform)
+        : platform(std::move(platform)) {}
+
+    PlatformCounters counters;
+
+    bool FlushForegroundTasks(Isolate *isolate) override {
+        return platform->FlushForegroundTasks(isolate);
+    }
+    void DrainTasks(Isolate *isolate) override {
+        platform->DrainTasks(isolate);
+    }
+    void RegisterIsolate(Isolate *isolate, uv_loop_s *loop) override {
+        platform->RegisterIsolate(isolate, loop);
+    }
+    void RegisterIsolate(Isolate *isolate,
+                         node::IsolatePlatformDelegate *delegate) override {
+        platform->RegisterIsolate(isolate, delegate);
+    }
+    void UnregisterIsolate(Isolate *isolate) override {
+        platform->UnregisterIsolate(isolate);
+    }
+    void AddIsolateFinishedCallback(Isolate *isolate, void (*callback)(void *),
+                                    void *data) override {
+        platform->AddIsolateFinishedCallback(isolate, callback, data);
+    }
+
+    v8::PageAllocator *GetPageAllocator() override {
+        return platform->GetPageAllocator();
+    }
+    int NumberOfWorkerThreads() override {
+        return platform->NumberOfWorkerThreads();
+    }
+    // Node's foreground runners ignore the priority, and only this overload
+    // can be overridden on every V8 version Node ships.
+    std::shared_ptr<v8::TaskRunner>
+    GetForegroundTaskRunner(Isolate *isolate,
+                            v8::TaskPriority priority) override {
+        return platform->GetForegroundTaskRunner(isolate);
+    }
+    bool IdleTasksEnabled(Isolate *isolate) override {
+        return platform->IdleTasksEnabled(isolate);
+    }
+    double MonotonicallyIncreasingTime() override {
+        return platform->MonotonicallyIncreasingTime();
+    }
+    double CurrentClockTimeMillis() override {
+        return platform->CurrentClockTimeMillis();
+    }
+    v8::TracingController *GetTracingController() override {
+        return platform->GetTracingController();
+    }
+
+  protected:
+    std::unique_ptr<v8::JobHandle>
+    CreateJobImpl(v8::TaskPriority priority, std::unique_ptr<v8::JobTask> task,
+                  const v8::SourceLocation &location) override {
+        auto counted =
+            std::make_unique<CountedJobTask>(std::move(task), counters);
+        return platform->CreateJob(priority, std::move(counted), location);
+    }
+    void
+    PostTaskOnWorkerThreadImpl(v8::TaskPriority priority,
+                               std::unique_ptr<v8::Task> task,
+                               const v8::SourceLocation &location) override {
+        auto counted = std::make_unique<CountedTask>(std::move(task), counters);
+        switch (priority) {
+        case v8::TaskPriority::kUserBlocking:
+            platform->CallBlockingTaskOnWorkerThread(std::move(counted),
+                                                     location);
+            break;
+        case v8::TaskPriority::kBestEffort:
+            platform->CallLowPriorityTaskOnWorkerThread(std::move(counted),
+                                                        location);
+            break;
+        default:
+            platform->CallOnWorkerThread(std::move(counted), location);
+        }
+    }
+    void PostDelayedTaskOnWorkerThreadImpl(
+        v8::TaskPriority priority, std::unique_ptr<v8::Task> task,
+        double delay_in_seconds, const v8::SourceLocation &location) override {
+        platform->CallDelayedOnWorkerThread(
+            std::make_unique<CountedTask>(std::move(task), counters),
+            delay_in_seconds, location);
+    }
+
+  private:
+    // Destroyed first, tasks it still holds refer to the counters.
+    std::unique_ptr<MultiIsolatePlatform> platform;
+};
+
+// Libuv has one threadpool per process. A no-op work item queued from a
+// private loop measures how long work waits for a free thread.
+struct ThreadpoolProbe {
+    uv_loop_t loop;
+    uv_work_t work;
+    bool pending = false;
+    uint64_t queued_at = 0;
+    std::atomic<uint64_t> started_at{0};
+    uint64_t last_wait = 0;
+};
+
+static void queue_probe(ThreadpoolProbe *probe) {
+    probe->work.data = probe;
+    probe->started_at = 0;
+    probe->queued_at = uv_hrtime();
+    probe->pending =
+        uv_queue_work(
+            &probe->loop, &probe->work,
+            [](uv_work_t *work) {
+                static_cast<ThreadpoolProbe *>(work->data)->started_at =
+                    uv_hrtime();
+            },
+            [](uv_work_t *work, int status) {
+                auto *probe = static_cast<ThreadpoolProbe *>(work->data);
+                probe->pending = false;
+                probe->last_wait = probe->started_at - probe->queued_at;
+            }) == 0;
+}
+
+// Threads inherit the affinity of the thread creating them, the platform
+// workers and the libuv threadpool are pinned by narrowing the affinity of
+// the calling thread while they start.
+struct PinScope {
+#ifdef __linux__
+    cpu_set_t saved;
+    bool pinned = false;
+
+    explicit PinScope(const std::vector<int> &cpus) {
+        if (cpus.empty() || pthread_getaffinity_np(pthread_self(),
+                                                   sizeof(saved), &saved)) {
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        pinned = pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+        if (!pinned) {
+            std::cerr << "PYTHONODEJS: Could not pin worker threads, invalid "
+                         "CPU list."
+                      << std::endl;
+        }
+    }
+
+    ~PinScope() {
+        if (pinned) {
+            pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+        }
+    }
+#else
+    explicit PinScope(const std::vector<int> &cpus) {
+        if (!cpus.empty()) {
+            std::cerr << "PYTHONODEJS: Pinning worker threads is only "
+                         "supported on Linux."
+                      << std::endl;
+        }
+    }
+#endif
+};
 
-    std::shared_ptr<node::InitializationResult> result =
-        node::InitializeOncePerProcess(
-            args,
-            {
-                node::ProcessInitializationFlags::kNoInitializeV8,
-                node::ProcessInitializationFlags::kNoInitializeNodeV8Platform,
-                node::ProcessInitializationFlags::kDisableNodeOptionsEnv,
-                node::ProcessInitializationFlags::kNoInitializeCppgc,
-            });
+// Node and V8 are initialized once per process, every context shares the
+// platform (and its worker threads) and gets its own isolate and loop.
+static std::mutex process_mutex;
+static std::unique_ptr<CountingPlatform> process_platform;
+static std::vector<std::string> process_args;
+static std::vector<std::string> process_exec_args;
+static int process_workers = 4;
+static int process_uv_threads = 0;
+static std::vector<int> process_cpus;
+static ThreadpoolProbe *process_probe = nullptr;
+
+int Node_Configure(int platform_workers, int uv_threadpool_size,
+                   const int *cpus, int num_cpus) {
+    std::lock_guard<std::mutex> lock(process_mutex);
+    if (process_platform) {
+        return 1;
+    }
+    if (platform_workers > 0) {
+        process_workers = platform_workers;
+    }
+    process_uv_threads = uv_threadpool_size;
+    process_cpus.assign(cpus, cpus + std::max(num_cpus, 0));
+    return 0;
+}
 
-    for (const std::string &error : result->errors())
-        fprintf(stderr, "%s: %s\n", args[0].c_str(), error.c_str());
+// Size libuv reads from UV_THREADPOOL_SIZE when its threadpool starts.
+static int uv_threadpool_size() {
+    const char *size = getenv("UV_THREADPOOL_SIZE");
+    int threads = size ? atoi(size) : 4;
+    return std::clamp(threads, 1, 1024);
+}
 
-    if (result->early_return() != 0)
-        return result->exit_code();
+void Node_Platform_Stats(NodePlatformStats *stats) {
+    std::lock_guard<std::mutex> lock(process_mutex);
+    *stats = {};
+    if (!process_platform) {
+        return;
+    }
+    PlatformCounters &counters = process_platform->counters;
+    stats->platform_workers = process_platform->NumberOfWorkerThreads();
+    stats->uv_threadpool_size = uv_threadpool_size();
+    stats->tasks_queued = counters.queued;
+    stats->tasks_running = counters.running;
+    stats->tasks_completed = counters.completed;
+    stats->jobs_running = counters.jobs_running;
+
+    ThreadpoolProbe *probe = process_probe;
+    if (probe->pending) {
+        uv_run(&probe->loop, UV_RUN_NOWAIT);
+    }
+    if (probe->pending) {
+        // Still queued, it has waited at least this long.
+        stats->uv_probe_wait_ns =
+            std::max(probe->last_wait, uv_hrtime() - probe->queued_at);
+    } else {
+        stats->uv_probe_wait_ns = probe->last_wait;
+        queue_probe(probe);
+    }
+}
 
-    std::unique_ptr<MultiIsolatePlatform> platform =
-        MultiIsolatePlatform::Create(4);
-    V8::InitializePlatform(platform.get());
-    cppgc::InitializeProcess(platform->GetPageAllocator());
-    V8::Initialize();
+int NodeContext_Setup(NodeContext *context, int argc, char **argv) {
+    std::lock_guard<std::mutex> lock(process_mutex);
+
+    if (!process_platform) {
+        argv = uv_setup_args(argc, argv);
+        std::vector<std::string> args(argv, argv + argc);
+
+        std::shared_ptr<node::InitializationResult> result =
+            node::InitializeOncePerProcess(
+                args,
+                {
+                    node::ProcessInitializationFlags::kNoInitializeV8,
+                    node::ProcessInitializationFlags::
+                        kNoInitializeNodeV8Platform,
+                    node::ProcessInitializationFlags::kDisableNodeOptionsEnv,
+                    node::ProcessInitializationFlags::kNoInitializeCppgc,
+                });
+
+        for (const std::string &error : result->errors())
+            fprintf(stderr, "%s: %s\n", args[0].c_str(), error.c_str());
+
+        if (result->early_return() != 0)
+            return result->exit_code();
+
+        if (process_uv_threads > 0) {
+            uv_os_setenv("UV_THREADPOOL_SIZE",
+                         std::to_string(process_uv_threads).c_str());
+        }
 
-    context->platform = std::move(platform);
+        std::unique_ptr<CountingPlatform> platform;
+        ThreadpoolProbe *probe = new ThreadpoolProbe();
+        uv_loop_init(&probe->loop);
+        {
+            PinScope pin(process_cpus);
+            platform = std::make_unique<CountingPlatform>(
+                MultiIsolatePlatform::Create(process_workers));
+            // Starts the libuv threadpool while pinned.
+            queue_probe(probe);
+        }
+        V8::InitializePlatform(platform.get());
+        cppgc::InitializeProcess(platform->GetPageAllocator());
+        V8::Initialize();
+
+        process_platform = std::move(platform);
+        process_probe = probe;
+        process_args = {result->args()[0]};
+        process_exec_args = result->exec_args();
+    }
 
-    context->args = {result->args()[0]};
-    context->exec_args = result->exec_args();
+    context->platform = process_platform.get();
+    context->args = process_args;
+    context->exec_args = process_exec_args;
 
-    return result->exit_code();
+    return 0;
 }
 
 void NodeContext_SetCallback(NodeContext *context, Callback cb) {
@@ -178,653 +937,759 @@ void NodeContext_SetFutureCallback(NodeContext *context, FutureCallback cb) {
     context->future_callback = cb;
 }
 
-NodeValue to_node_value(NodeContext *context, v8::Local<Context> local_ctx,
-                        v8::Local<Value> value);
+void NodeContext_SetLazy(NodeContext *context, bool lazy) {
+    if (!context) {
+        std::cerr << "PYTHONODEJS: NodeContext_SetLazy called with NULL context!"
+                  << std::endl;
+        return;
+    }
+    context->lazy = lazy;
+}
+
+void NodeContext_SetSnapshot(NodeContext *context, const char *path) {
+    if (!context) {
+        std::cerr
+            << "PYTHONODEJS: NodeContext_SetSnapshot called with NULL context!"
+            << std::endl;
+        return;
+    }
+    context->snapshot_path = path ? path : "";
+}
 
-void promise_callback(const v8::FunctionCallbackInfo<v8::Value> &args) {
+static void sweep_code_cache(NodeContext *context);
 
-    v8::Local<v8::External> data = v8::Local<v8::External>::Cast(args.Data());
-    FutureInfo *info = static_cast<FutureInfo *>(data->Value());
+void NodeContext_SetCodeCache(NodeContext *context, const char *dir,
+                              uint64_t max_bytes) {
+    if (!context) {
+        std::cerr
+            << "PYTHONODEJS: NodeContext_SetCodeCache called with NULL context!"
+            << std::endl;
+        return;
+    }
+    context->code_cache_dir = dir ? dir : "";
+    context->code_cache_limit = max_bytes;
+    if (!context->code_cache_dir.empty()) {
+        sweep_code_cache(context);
+    }
+}
 
-    NodeContext *context = info->context;
+NodeValue to_node_value(NodeContext *context, NodeArena &arena,
+                        v8::Local<Context> local_ctx, v8::Local<Value> value,
+                        v8::Local<Value> recv = v8::Local<Value>());
+
+// settle(id, value, rejected), queues the outcome of a bridged promise.
+static void settle_future(const v8::FunctionCallbackInfo<v8::Value> &args) {
+    NodeContext *context =
+        static_cast<NodeContext *>(args.Data().As<v8::External>()->Value());
+    FutureTable &futures = context->futures;
+    v8::Local<Context> local_ctx =
+        context->global_ctx.Get(context->isolate);
+    if (futures.settled == nullptr) {
+        futures.settled = new_result();
+    }
+    NodeValue head = {
+        .type = PROMISE,
+        .subtype = static_cast<uint16_t>(args[2]->IsTrue()),
+        .val_int = static_cast<int64_t>(args[0].As<v8::Number>()->Value())};
+    CallTiming timing(context);
+    NodeValue value =
+        to_node_value(context, *futures.settled->arena, local_ctx, args[1]);
+    futures.settled_values.push_back(head);
+    futures.settled_values.push_back(value);
+    timing.lap(PHASE_RESULT);
+    timing.record(TIMING_SETTLE, "");
+}
 
-    v8::Isolate *isolate = args.GetIsolate();
-    Locker locker(isolate);
-    Isolate::Scope isolate_scope(isolate);
-    v8::HandleScope handle_scope(isolate);
-    v8::Local<Context> local_ctx = context->global_ctx.Get(isolate);
-    NodeValue result = to_node_value(context, local_ctx, args[0]);
-    if (context->future_callback) {
-        context->future_callback(info->id, result, info->rejected);
+// Built once per context. `then` is captured up front so that user code
+// patching Promise.prototype can not intercept the bridge.
+static const char kFutureBridge[] = R"((settle) => {
+    const then = Promise.prototype.then;
+    const apply = Reflect.apply;
+    return (promise, id) => {
+        apply(then, promise, [
+            (value) => settle(id, value, false),
+            (error) => settle(id, error, true),
+        ]);
+    };
+})";
+
+static v8::MaybeLocal<v8::Function>
+future_bridge(NodeContext *context, v8::Local<Context> local_ctx) {
+    Isolate *isolate = context->isolate;
+    if (!context->futures.bridge.IsEmpty()) {
+        return context->futures.bridge.Get(isolate);
+    }
+    v8::Local<v8::Script> script;
+    v8::Local<Value> factory;
+    v8::Local<v8::Function> settle;
+    v8::Local<Value> bridge;
+    if (!v8::Script::Compile(local_ctx, v8::String::NewFromUtf8Literal(
+                                            isolate, kFutureBridge))
+             .ToLocal(&script) ||
+        !script->Run(local_ctx).ToLocal(&factory) ||
+        !v8::FunctionTemplate::New(isolate, settle_future,
+                                   v8::External::New(isolate, context))
+             ->GetFunction(local_ctx)
+             .ToLocal(&settle)) {
+        return {};
     }
+    v8::Local<Value> argv[] = {settle};
+    if (!factory.As<v8::Function>()
+             ->Call(local_ctx, v8::Undefined(isolate), 1, argv)
+             .ToLocal(&bridge)) {
+        return {};
+    }
+    context->futures.bridge.Reset(isolate, bridge.As<v8::Function>());
+    return bridge.As<v8::Function>();
+}
+
+// Writes the UTF-8 form of `value` straight into the arena.
+static NodeValue string_value(NodeArena &arena, Isolate *isolate,
+                              v8::Local<Context> local_ctx,
+                              v8::Local<Value> value, uint16_t type = STRING) {
+    v8::Local<v8::String> str;
+    if (value->IsString()) {
+        str = value.As<v8::String>();
+    } else if (value->IsSymbol() || !value->ToString(local_ctx).ToLocal(&str)) {
+        str = v8::String::Empty(isolate);
+    }
+    size_t length = str->Utf8Length(isolate);
+    char *data = static_cast<char *>(arena.alloc(length + 1, 1));
+    str->WriteUtf8(isolate, data, static_cast<int>(length), nullptr,
+                   v8::String::NO_NULL_TERMINATION |
+                       v8::String::REPLACE_INVALID_UTF8);
+    data[length] = '\0';
+    return {.type = type,
+            .length = static_cast<uint32_t>(length),
+            .val_string = data};
+}
+
+// Returns the id of an object key, interning it on first sight, or 0 once
+// the table is full.
+static uint16_t key_id(NodeContext *context, v8::Local<v8::String> key) {
+    KeyTable &keys = context->keys;
+    auto range = keys.hashes.equal_range(key->GetIdentityHash());
+    for (auto it = range.first; it != range.second; ++it) {
+        if (keys.strings[it->second - 1]
+                .Get(context->isolate)
+                ->StringEquals(key)) {
+            return it->second;
+        }
+    }
+    if (keys.full()) {
+        return 0;
+    }
+    std::string name(key->Utf8Length(context->isolate), '\0');
+    key->WriteUtf8(context->isolate, name.data(),
+                   static_cast<int>(name.size()), nullptr,
+                   v8::String::NO_NULL_TERMINATION |
+                       v8::String::REPLACE_INVALID_UTF8);
+    return keys.add(context->isolate, key, std::move(name));
+}
+
+// Object keys point into the key table instead of the arena.
+static NodeValue key_value(NodeContext *context, NodeArena &arena,
+                           v8::Local<Context> local_ctx, v8::Local<Value> key) {
+    uint16_t id = 0;
+    if (key->IsString()) {
+        id = key_id(context, key.As<v8::String>());
+    }
+    if (id == 0) {
+        return string_value(arena, context->isolate, local_ctx, key);
+    }
+    const std::string &name = context->keys.names[id - 1];
+    return {.type = STRING,
+            .subtype = id,
+            .length = static_cast<uint32_t>(name.size()),
+            .val_string = const_cast<char *>(name.data())};
+}
+
+static NodeValue property_value(NodeContext *context, NodeArena &arena,
+                                v8::Local<Context> local_ctx,
+                                v8::Local<v8::Object> object, const char *name) {
+    v8::Local<Value> result;
+    if (!object
+             ->Get(local_ctx,
+                   v8::String::NewFromUtf8(context->isolate, name)
+                       .ToLocalChecked())
+             .ToLocal(&result)) {
+        result = v8::String::Empty(context->isolate);
+    }
+    return string_value(arena, context->isolate, local_ctx, result);
+}
+
+static bool typed_array_type(v8::Local<Value> value, TypedArrayType *type) {
+    if (value->IsInt8Array()) {
+        *type = INT8_T;
+    } else if (value->IsUint8Array() || value->IsUint8ClampedArray()) {
+        *type = UINT8_T;
+    } else if (value->IsInt16Array()) {
+        *type = INT16_T;
+    } else if (value->IsUint16Array()) {
+        *type = UINT16_T;
+    } else if (value->IsInt32Array()) {
+        *type = INT32_T;
+    } else if (value->IsUint32Array()) {
+        *type = UINT32_T;
+    } else if (value->IsBigInt64Array()) {
+        *type = BINT64_T;
+    } else if (value->IsBigUint64Array()) {
+        *type = BUINT64_T;
+    } else if (value->IsFloat32Array()) {
+        *type = FLOAT32_T;
+    } else if (value->IsFloat64Array()) {
+        *type = FLOAT64_T;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static size_t typed_array_element_size(TypedArrayType type) {
+    switch (type) {
+    case INT8_T:
+    case UINT8_T:
+        return 1;
+    case INT16_T:
+    case UINT16_T:
+        return 2;
+    case INT32_T:
+    case UINT32_T:
+    case FLOAT32_T:
+        return 4;
+    case BINT64_T:
+    case BUINT64_T:
+    case FLOAT64_T:
+        return 8;
+    }
+    return 0;
+}
+
+static void release_python_buffer(void *data, size_t length,
+                                  void *deleter_data) {
+    NodeContext *context = static_cast<NodeContext *>(deleter_data);
+    std::lock_guard<std::mutex> lock(context->released_mutex);
+    context->released.push_back(data);
+}
+
+// Characters of a Python string used in place by V8, returned to Python
+// like lent buffers once V8 is done with them.
+template <typename Resource, typename Char>
+class PythonString : public Resource {
+  public:
+    PythonString(NodeContext *context, const Char *chars, size_t count)
+        : context(context), chars(chars), count(count) {}
+
+    const Char *data() const override { return chars; }
+    size_t length() const override { return count; }
+
+    void Dispose() override {
+        release_python_buffer(const_cast<Char *>(chars), count, context);
+        delete this;
+    }
+
+  private:
+    NodeContext *context;
+    const Char *chars;
+    size_t count;
+};
+
+using PythonOneByteString =
+    PythonString<v8::String::ExternalOneByteStringResource, char>;
+using PythonTwoByteString =
+    PythonString<v8::String::ExternalStringResource, uint16_t>;
+
+// Strings are copied in their V8 representation, decoding Latin-1 or UTF-16
+// in Python is cheaper than transcoding to UTF-8 here.
+static NodeValue text_value(NodeArena &arena, Isolate *isolate,
+                            v8::Local<v8::String> str) {
+    int length = str->Length();
+    if (str->IsOneByte()) {
+        uint8_t *data = static_cast<uint8_t *>(arena.alloc(length, 1));
+        str->WriteOneByte(isolate, data, 0, length,
+                          v8::String::NO_NULL_TERMINATION);
+        return {.type = STRING_ONE_BYTE,
+                .length = static_cast<uint32_t>(length),
+                .val_ptr = data};
+    }
+    uint16_t *data = static_cast<uint16_t *>(
+        arena.alloc(length * sizeof(uint16_t), alignof(uint16_t)));
+    str->Write(isolate, data, 0, length, v8::String::NO_NULL_TERMINATION);
+    return {.type = STRING_TWO_BYTE,
+            .length = static_cast<uint32_t>(length),
+            .val_ptr = data};
+}
+
+static NodeValue buffer_value(NodeContext *context, uint16_t type,
+                              uint16_t subtype,
+                              std::shared_ptr<v8::BackingStore> store,
+                              size_t offset, size_t length) {
+    HandleTable::Slot *buffer;
+    uint64_t ref = context->handles.add(&buffer);
+    buffer->data = static_cast<uint8_t *>(store->Data()) + offset;
+    buffer->byte_length = length;
+    buffer->store = std::move(store);
+    return {.type = type,
+            .subtype = subtype,
+            .length = static_cast<uint32_t>(length),
+            .val_ref = ref};
+}
+
+// Resolves a handle value passed back by Python, NULL once it was released.
+static HandleTable::Slot *handle_slot(NodeContext *context,
+                                      const NodeValue &value) {
+    HandleTable::Slot *slot = context->handles.get(value.val_ref);
+    if (slot == nullptr) {
+        std::cerr << "PYTHONODEJS: Stale or invalid handle." << std::endl;
+    }
+    return slot;
 }
 
-NodeValue to_node_value(NodeContext *context, v8::Local<Context> local_ctx,
-                        v8::Local<Value> value) {
-    v8::Global<v8::Value> *self_heap =
-        new v8::Global<v8::Value>(context->isolate, value);
+NodeValue to_node_value(NodeContext *context, NodeArena &arena,
+                        v8::Local<Context> local_ctx, v8::Local<Value> value,
+                        v8::Local<Value> recv) {
+    Isolate *isolate = context->isolate;
     if (value->IsUndefined()) {
-        self_heap->Reset();
         return {.type = UNDEFINED};
     } else if (value->IsNull()) {
-        self_heap->Reset();
         return {.type = NULL_T};
     } else if (value->IsNumber()) {
-        self_heap->Reset();
         return {.type = NUMBER, .val_num = value.As<v8::Number>()->Value()};
     } else if (value->IsBoolean()) {
-        self_heap->Reset();
         return {.type = BOOLEAN_T,
                 .val_bool = value.As<v8::Boolean>()->Value()};
     } else if (value->IsString()) {
-        self_heap->Reset();
-        v8::String::Utf8Value utf8(context->isolate, value.As<v8::String>());
-        return {.type = STRING, .val_string = strdup(*utf8)};
+        return text_value(arena, isolate, value.As<v8::String>());
     } else if (value->IsSymbol()) {
         v8::Local<v8::Symbol> symbol = value.As<v8::Symbol>();
-        v8::String::Utf8Value utf8(context->isolate,
-                                   symbol->Description(context->isolate));
-        return {.type = SYMBOL,
-                .val_string = strdup(*utf8),
-                .val_external_ptr = static_cast<void *>(self_heap)};
+        HandleTable::Slot *handle;
+        uint64_t ref = context->handles.add(&handle);
+        handle->value.Reset(isolate, value);
+        v8::Local<Value> description = symbol->Description(isolate);
+        if (!description->IsUndefined()) {
+            v8::String::Utf8Value utf8(isolate, description);
+            handle->name = *utf8 ? *utf8 : "";
+        }
+        return {.type = SYMBOL, .val_ref = ref};
     } else if (value->IsBigInt()) {
-        self_heap->Reset();
-        v8::String::Utf8Value utf8(
-            context->isolate,
-            value.As<v8::BigInt>()->ToString(local_ctx).ToLocalChecked());
-        return {.type = BIGINT, .val_big = strdup(*utf8)};
+        v8::Local<v8::BigInt> bigint = value.As<v8::BigInt>();
+        bool lossless;
+        int64_t small = bigint->Int64Value(&lossless);
+        if (lossless) {
+            return {.type = BIGINT, .val_int = small};
+        }
+        int sign_bit;
+        int count = bigint->WordCount();
+        uint64_t *words = static_cast<uint64_t *>(
+            arena.alloc(count * sizeof(uint64_t), alignof(uint64_t)));
+        bigint->ToWordsArray(&sign_bit, &count, words);
+        return {.type = BIGINT,
+                .subtype = static_cast<uint16_t>(sign_bit),
+                .length = static_cast<uint32_t>(count),
+                .val_ptr = words};
     } else if (value->IsFunction()) {
-        NodeValue ret = {};
         v8::Local<v8::Function> func = value.As<v8::Function>();
-        v8::String::Utf8Value utf8(context->isolate, func->GetName());
-        Func *f = new Func();
-        f->function.Reset(context->isolate, func);
-        ret.type = FUNCTION;
-        ret.self_ptr = self_heap;
-        ret.val_string = strdup(*utf8);
-        ret.function = f;
-        return ret;
+        v8::String::Utf8Value utf8(isolate, func->GetName());
+        HandleTable::Slot *f;
+        uint64_t ref = context->handles.add(&f);
+        f->value.Reset(isolate, func);
+        if (!recv.IsEmpty()) {
+            f->recv.Reset(isolate, recv);
+        }
+        f->name = *utf8 ? *utf8 : "";
+        return {.type = FUNCTION, .val_ref = ref};
     } else if (value->IsArray()) {
         v8::Local<v8::Array> array = value.As<v8::Array>();
-        int length = array->Length();
-        NodeValue *arr = (NodeValue *)malloc(length * sizeof(NodeValue));
-        NodeValue nv = {.type = ARRAY,
-                        .self_ptr = self_heap,
-                        .val_array = arr,
-                        .val_array_len = length};
-        for (int i = 0; i < length; i++) {
-            arr[i] = to_node_value(context, local_ctx,
-                                   array->Get(local_ctx, i).ToLocalChecked());
-            Val *parent = new Val();
-            parent->value.Reset(context->isolate, value);
-            arr[i].parent = parent;
+        uint32_t length = array->Length();
+        if (context->lazy) {
+            HandleTable::Slot *handle;
+            uint64_t ref = context->handles.add(&handle);
+            handle->value.Reset(isolate, value);
+            return {.type = LAZY_ARRAY, .length = length, .val_ref = ref};
         }
-        return nv;
+        NodeValue *arr = arena.values(length);
+        for (uint32_t i = 0; i < length; i++) {
+            v8::Local<Value> elem;
+            if (array->Get(local_ctx, i).ToLocal(&elem)) {
+                arr[i] = to_node_value(context, arena, local_ctx, elem, value);
+            }
+        }
+        return {.type = ARRAY, .length = length, .val_children = arr};
     } else if (value->IsDate()) {
-        self_heap->Reset();
-        v8::Local<v8::Date> date = value.As<v8::Date>();
-        return {.type = DATE_T, .val_date_unix = date->ValueOf()};
+        return {.type = DATE_T, .val_num = value.As<v8::Date>()->ValueOf()};
     } else if (value->IsNativeError()) {
-        self_heap->Reset();
         v8::Local<v8::Object> error_obj = value.As<v8::Object>();
-
-        char *message;
-        char *name;
-        char *stack;
-
-        v8::Local<v8::Value> message_val;
-        if (error_obj
-                ->Get(local_ctx,
-                      v8::String::NewFromUtf8(context->isolate, "message")
-                          .ToLocalChecked())
-                .ToLocal(&message_val)) {
-            v8::String::Utf8Value utf8(context->isolate, message_val);
-            message = *utf8;
-        }
-
-        v8::Local<v8::Value> name_val;
-        if (error_obj
-                ->Get(local_ctx,
-                      v8::String::NewFromUtf8(context->isolate, "name")
-                          .ToLocalChecked())
-                .ToLocal(&name_val)) {
-            v8::String::Utf8Value utf8(context->isolate, name_val);
-            name = *utf8;
-        }
-
-        v8::Local<v8::Value> stack_val;
-        if (error_obj
-                ->Get(local_ctx,
-                      v8::String::NewFromUtf8(context->isolate, "stack")
-                          .ToLocalChecked())
-                .ToLocal(&stack_val)) {
-            v8::String::Utf8Value utf8(context->isolate, stack_val);
-            stack = *utf8;
-        }
-
-        return {.type = ERROR_T,
-                .error_message = strdup(message),
-                .error_name = strdup(name),
-                .error_stack = strdup(stack)};
+        NodeValue *fields = arena.values(3);
+        fields[0] =
+            property_value(context, arena, local_ctx, error_obj, "message");
+        fields[1] =
+            property_value(context, arena, local_ctx, error_obj, "name");
+        fields[2] =
+            property_value(context, arena, local_ctx, error_obj, "stack");
+        return {.type = ERROR_T, .length = 3, .val_children = fields};
     } else if (value->IsRegExp()) {
-        self_heap->Reset();
         v8::Local<v8::RegExp> regex = value.As<v8::RegExp>();
-        v8::Local<v8::String> pattern = regex->GetSource();
-        v8::RegExp::Flags flags = regex->GetFlags();
-        v8::String::Utf8Value utf8(context->isolate, pattern);
-        return {.type = REGEXP,
-                .val_string = strdup(*utf8),
-                .val_regex_flags = static_cast<int>(flags)};
+        NodeValue nv =
+            string_value(arena, isolate, local_ctx, regex->GetSource(), REGEXP);
+        nv.subtype = static_cast<uint16_t>(regex->GetFlags());
+        return nv;
     } else if (value->IsPromise()) {
-        v8::Local<v8::Promise> promise = value.As<v8::Promise>();
-        int64_t id = randomInt64();
-
-        Locker locker(context->isolate);
-        Isolate::Scope isolate_scope(context->isolate);
-        HandleScope handle_scope(context->isolate);
-        v8::Local<Context> local_ctx =
-            context->global_ctx.Get(context->isolate);
-
-        FutureInfo *thenInfo = new FutureInfo;
-        thenInfo->id = id;
-        thenInfo->context = context;
-        thenInfo->rejected = false;
-        v8::Local<v8::External> then_external =
-            v8::External::New(context->isolate, thenInfo);
-
-        v8::Local<v8::FunctionTemplate> then_tpl = v8::FunctionTemplate::New(
-            context->isolate, promise_callback, then_external);
-        v8::Local<v8::Function> then_fn =
-            then_tpl->GetFunction(local_ctx).ToLocalChecked();
-        promise->Then(local_ctx, then_fn).ToLocalChecked();
-
-        FutureInfo *catchInfo = new FutureInfo;
-        catchInfo->id = id;
-        catchInfo->context = context;
-        catchInfo->rejected = true;
-        v8::Local<v8::External> catch_external =
-            v8::External::New(context->isolate, catchInfo);
-
-        v8::Local<v8::FunctionTemplate> catch_tpl = v8::FunctionTemplate::New(
-            context->isolate, promise_callback, catch_external);
-        v8::Local<v8::Function> catch_fn =
-            catch_tpl->GetFunction(local_ctx).ToLocalChecked();
-        promise->Catch(local_ctx, catch_fn).ToLocalChecked();
-        return {.type = PROMISE, .self_ptr = self_heap, .future_id = id};
+        int64_t id = context->futures.acquire();
+        v8::Local<v8::Function> bridge;
+        v8::Local<Value> argv[] = {value,
+                                   v8::Number::New(isolate, (double)id)};
+        if (!future_bridge(context, local_ctx).ToLocal(&bridge) ||
+            bridge->Call(local_ctx, v8::Undefined(isolate), 2, argv)
+                .IsEmpty()) {
+            context->futures.free_ids.push_back(id);
+            return {.type = UNDEFINED};
+        }
+        return {.type = PROMISE, .val_int = id};
     } else if (value->IsMap()) {
-        v8::Local<v8::Map> map = value.As<v8::Map>();
         v8::Local<v8::Array> array =
-            map->AsArray(); // [key1, val1, key2, val2, ...]
-
-        int len = array->Length() / 2;
-
-        NodeValue *keys = (NodeValue *)malloc(len * sizeof(NodeValue));
-        NodeValue *values = (NodeValue *)malloc(len * sizeof(NodeValue));
-        NodeValue nv = {.type = MAP,
-                        .self_ptr = self_heap,
-                        .map_keys = keys,
-                        .object_values = values,
-                        .object_len = len};
-        for (uint32_t i = 0; i < len; i++) {
-            v8::Local<v8::Value> key =
-                array->Get(local_ctx, i * 2).ToLocalChecked();
-            v8::Local<v8::Value> val =
-                array->Get(local_ctx, i * 2 + 1).ToLocalChecked();
-            keys[i / 2] = to_node_value(context, local_ctx, key);
-            values[i / 2] = to_node_value(context, local_ctx, value);
+            value.As<v8::Map>()->AsArray(); // [key1, val1, key2, val2, ...]
+        uint32_t len = array->Length() / 2;
+        NodeValue *pairs = arena.values(len * 2);
+        for (uint32_t i = 0; i < len * 2; i++) {
+            pairs[i] = to_node_value(context, arena, local_ctx,
+                                     array->Get(local_ctx, i).ToLocalChecked());
         }
-        return nv;
+        return {.type = MAP, .length = len, .val_children = pairs};
     } else if (value->IsSet()) {
-        v8::Local<v8::Set> set = value.As<v8::Set>();
-        v8::Local<v8::Array> entries = set->AsArray();
-
-        int len = entries->Length();
-
-        NodeValue *arr = (NodeValue *)malloc(len * sizeof(NodeValue));
+        v8::Local<v8::Array> entries = value.As<v8::Set>()->AsArray();
+        uint32_t len = entries->Length();
+        NodeValue *arr = arena.values(len);
         for (uint32_t i = 0; i < len; ++i) {
-            v8::Local<v8::Value> val =
-                entries->Get(local_ctx, i).ToLocalChecked();
-            arr[i] = to_node_value(context, local_ctx, val);
+            arr[i] = to_node_value(context, arena, local_ctx,
+                                   entries->Get(local_ctx, i).ToLocalChecked());
         }
-        return {.type = SET,
-                .self_ptr = self_heap,
-                .val_array = arr,
-                .val_array_len = len};
+        return {.type = SET, .length = len, .val_children = arr};
     } else if (value->IsArrayBuffer()) {
-        self_heap->Reset();
-        v8::Local<v8::ArrayBuffer> buffer = value.As<v8::ArrayBuffer>();
-        std::shared_ptr<v8::BackingStore> backing = buffer->GetBackingStore();
-
-        void *src = backing->Data();
-        size_t size = backing->ByteLength();
-
-        void *dest = malloc(size);
-        memcpy(dest, src, size);
-        return {.type = ARRAY_BUFFER,
-                .val_tarray = dest,
-                .val_array_len = static_cast<int>(size)};
+        std::shared_ptr<v8::BackingStore> store =
+            value.As<v8::ArrayBuffer>()->GetBackingStore();
+        size_t size = store->ByteLength();
+        return buffer_value(context, ARRAY_BUFFER, 0, std::move(store), 0,
+                            size);
     } else if (value->IsDataView()) {
-        self_heap->Reset();
-        auto arr = value.As<v8::DataView>();
-        v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-        uint8_t *data =
-            static_cast<uint8_t *>(buffer->GetBackingStore()->Data()) +
-            arr->ByteOffset();
-        size_t length = arr->ByteLength();
-        return {.type = ARRAY_BUFFER,
-                .val_tarray = data,
-                .val_array_len = static_cast<int>(length)};
+        v8::Local<v8::DataView> view = value.As<v8::DataView>();
+        return buffer_value(context, ARRAY_BUFFER, 0,
+                            view->Buffer()->GetBackingStore(),
+                            view->ByteOffset(), view->ByteLength());
     } else if (value->IsSharedArrayBuffer()) {
-        self_heap->Reset();
-        // TODO
+        std::shared_ptr<v8::BackingStore> store =
+            value.As<v8::SharedArrayBuffer>()->GetBackingStore();
+        size_t size = store->ByteLength();
+        return buffer_value(context, SHARED_ARRAY_BUFFER, 0, std::move(store),
+                            0, size);
     } else if (value->IsTypedArray()) {
-        self_heap->Reset();
-        if (value->IsInt8Array()) {
-            auto arr = value.As<v8::Int8Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            int8_t *data =
-                static_cast<int8_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .val_tarray = data,
-                    .val_tarray_type = INT8_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsUint8Array()) {
-            auto arr = value.As<v8::Int8Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            uint8_t *data =
-                static_cast<uint8_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = UINT8_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsUint8ClampedArray()) {
-            auto arr = value.As<v8::Uint8ClampedArray>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            int8_t *data =
-                static_cast<int8_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = UINT8_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsInt16Array()) {
-            auto arr = value.As<v8::Int16Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            int16_t *data =
-                static_cast<int16_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = INT16_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsUint16Array()) {
-            auto arr = value.As<v8::Uint16Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            uint16_t *data =
-                static_cast<uint16_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = UINT16_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsInt32Array()) {
-            auto arr = value.As<v8::Int32Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            int32_t *data =
-                static_cast<int32_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = INT32_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsUint32Array()) {
-            auto arr = value.As<v8::Uint32Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            uint32_t *data =
-                static_cast<uint32_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = UINT32_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsFloat32Array()) {
-            auto arr = value.As<v8::Float32Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            float *data =
-                static_cast<float *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = FLOAT32_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsFloat64Array()) {
-            auto arr = value.As<v8::Float64Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            double *data =
-                static_cast<double *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = FLOAT64_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsBigInt64Array()) {
-            auto arr = value.As<v8::BigInt64Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            long *data =
-                static_cast<long *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = BINT64_T,
-                    .val_array_len = static_cast<int>(length)};
-        } else if (value->IsBigUint64Array()) {
-            auto arr = value.As<v8::BigUint64Array>();
-            v8::Local<v8::ArrayBuffer> buffer = arr->Buffer();
-            uint64_t *data =
-                static_cast<uint64_t *>(buffer->GetBackingStore()->Data()) +
-                arr->ByteOffset();
-            size_t length = arr->ByteLength();
-            return {.type = TYPED_ARRAY,
-                    .self_ptr = self_heap,
-                    .val_tarray = data,
-                    .val_tarray_type = BUINT64_T,
-                    .val_array_len = static_cast<int>(length)};
-        }
-    } else if (value->IsDataView()) {
-        std::vector<int> v(10);
-        for (int i = 0; i <= v.size();
-             ++i) { // Off-by-one error (clang-tidy detects)
-            v[i] = i;
-        }
-    } else if (value->IsExternal()) { // at the end to not override other
-                                      // objects.
-        v8::Local<v8::Object> obj = value.As<v8::Object>();
-        v8::Local<v8::Array> keys =
-            obj->GetOwnPropertyNames(local_ctx).ToLocalChecked();
-        int length = keys->Length();
-        char **key_arr = (char **)malloc(length * sizeof(char *));
-        NodeValue *objects = (NodeValue *)malloc(length * sizeof(NodeValue));
-        NodeValue nv = {.type = EXTERNAL,
-                        .object_keys = key_arr,
-                        .object_values = objects,
-                        .object_len = length,
-                        .val_external_ptr = static_cast<void *>(self_heap)};
-        for (uint32_t i = 0; i < length; ++i) {
-            v8::Local<v8::Value> key = keys->Get(local_ctx, i).ToLocalChecked();
-            v8::String::Utf8Value utf8(context->isolate, key);
-            size_t len = strlen(*utf8);
-            key_arr[i] = (char *)malloc(len + 1); // +1 for null terminator
-            strcpy(key_arr[i], strdup(*utf8));
-            v8::Local<v8::Value> oval;
-            if (obj->Get(local_ctx, key).ToLocal(&oval)) {
-                objects[i] = to_node_value(context, local_ctx, oval);
-                Val *parent = new Val();
-                parent->value.Reset(context->isolate, value);
-                objects[i].parent = parent;
-            }
+        TypedArrayType kind;
+        if (typed_array_type(value, &kind)) {
+            // Also covers Node Buffers, which are Uint8Arrays.
+            v8::Local<v8::TypedArray> arr = value.As<v8::TypedArray>();
+            return buffer_value(context, TYPED_ARRAY,
+                                static_cast<uint16_t>(kind),
+                                arr->Buffer()->GetBackingStore(),
+                                arr->ByteOffset(), arr->ByteLength());
         }
-        return nv;
+    } else if (value->IsExternal()) {
+        return {.type = EXTERNAL, .val_ptr = value.As<v8::External>()->Value()};
     } else if (value->IsProxy()) {
-        self_heap->Reset();
         v8::Local<v8::Proxy> proxy = value.As<v8::Proxy>();
-        v8::Local<v8::Value> target = proxy->GetTarget();
-        v8::Local<v8::Value> handler = proxy->GetHandler();
-        NodeValue *node_target = (NodeValue *)malloc(sizeof(NodeValue));
-        node_target[0] = to_node_value(context, local_ctx, target);
-        NodeValue *node_handler = (NodeValue *)malloc(sizeof(NodeValue));
-        node_handler[0] = to_node_value(context, local_ctx, handler);
-        return {.type = PROXY,
-                .proxy_target = node_target,
-                .proxy_handler = node_handler};
+        NodeValue *parts = arena.values(2);
+        parts[0] = to_node_value(context, arena, local_ctx, proxy->GetTarget());
+        parts[1] =
+            to_node_value(context, arena, local_ctx, proxy->GetHandler());
+        return {.type = PROXY, .length = 2, .val_children = parts};
     } else if (value->IsObject()) { // at the end to not override other objects.
+        if (context->lazy) {
+            HandleTable::Slot *handle;
+            uint64_t ref = context->handles.add(&handle);
+            handle->value.Reset(isolate, value);
+            return {.type = LAZY_OBJECT, .val_ref = ref};
+        }
         v8::Local<v8::Object> obj = value.As<v8::Object>();
         v8::Local<v8::Array> keys =
             obj->GetOwnPropertyNames(local_ctx).ToLocalChecked();
-        int length = keys->Length();
-        char **key_arr = (char **)malloc(length * sizeof(char *));
-        NodeValue *objects = (NodeValue *)malloc(length * sizeof(NodeValue));
-        NodeValue nv = {.type = OBJECT,
-                        .self_ptr = self_heap,
-                        .object_keys = key_arr,
-                        .object_values = objects,
-                        .object_len = length};
+        uint32_t length = keys->Length();
+        NodeValue *pairs = arena.values(length * 2);
         for (uint32_t i = 0; i < length; ++i) {
-            v8::Local<v8::Value> key = keys->Get(local_ctx, i).ToLocalChecked();
-            v8::String::Utf8Value utf8(context->isolate, key);
-            size_t len = strlen(*utf8);
-            key_arr[i] = (char *)malloc(len + 1); // +1 for null terminator
-            strcpy(key_arr[i], strdup(*utf8));
-            v8::Local<v8::Value> oval;
+            v8::Local<Value> key = keys->Get(local_ctx, i).ToLocalChecked();
+            pairs[i * 2] = key_value(context, arena, local_ctx, key);
+            v8::Local<Value> oval;
             if (obj->Get(local_ctx, key).ToLocal(&oval)) {
-                objects[i] = to_node_value(context, local_ctx, oval);
-                Val *parent = new Val();
-                parent->value.Reset(context->isolate, value);
-                objects[i].parent = parent;
+                pairs[i * 2 + 1] =
+                    to_node_value(context, arena, local_ctx, oval, obj);
             }
         }
-        return nv;
+        return {.type = OBJECT, .length = length, .val_children = pairs};
     } else {
-        v8::String::Utf8Value typeStr(context->isolate,
-                                      value->TypeOf(context->isolate)
-                                          ->ToString(local_ctx)
-                                          .ToLocalChecked());
+        v8::String::Utf8Value typeStr(
+            isolate, value->TypeOf(isolate)->ToString(local_ctx).ToLocalChecked());
         std::cout << "PYTHONODEJS: Unsupported type \"" << *typeStr
                   << "\" ignored.\n";
     }
-    self_heap->Reset();
     return {};
 }
 
+// Converts a result as asked by the caller, see NodeTransfer.
+static NodeValue transfer_value(NodeContext *context, NodeArena &arena,
+                                v8::Local<Context> local_ctx,
+                                v8::Local<Value> value, int transfer) {
+    Isolate *isolate = context->isolate;
+    if (transfer == TRANSFER_JSON) {
+        v8::Local<v8::String> json;
+        // JSON.stringify gives undefined for these, not a string.
+        if (value->IsUndefined() || value->IsFunction() || value->IsSymbol() ||
+            !v8::JSON::Stringify(local_ctx, value).ToLocal(&json)) {
+            return {.type = UNDEFINED};
+        }
+        return string_value(arena, isolate, local_ctx, json, JSON_T);
+    } else if (transfer == TRANSFER_CLONE) {
+        v8::TryCatch try_catch(isolate);
+        v8::ValueSerializer serializer(isolate);
+        serializer.WriteHeader();
+        if (!serializer.WriteValue(local_ctx, value).FromMaybe(false)) {
+            std::cerr << "PYTHONODEJS: Result can not be cloned." << std::endl;
+            return {.type = UNDEFINED};
+        }
+        std::pair<uint8_t *, size_t> data = serializer.Release();
+        void *bytes = arena.alloc(data.second, 1);
+        memcpy(bytes, data.first, data.second);
+        free(data.first);
+        return {.type = SERIALIZED,
+                .length = static_cast<uint32_t>(data.second),
+                .val_ptr = bytes};
+    }
+    return to_node_value(context, arena, local_ctx, value);
+}
+
+static v8::Local<v8::String> v8_string(Isolate *isolate,
+                                       const NodeValue &value) {
+    if (value.val_string == nullptr) {
+        return v8::String::Empty(isolate);
+    }
+    return v8::String::NewFromUtf8(isolate, value.val_string,
+                                   v8::NewStringType::kNormal,
+                                   static_cast<int>(value.length))
+        .ToLocalChecked();
+}
+
+static v8::Local<v8::String> v8_text(NodeContext *context,
+                                    const NodeValue &value) {
+    Isolate *isolate = context->isolate;
+    int length = static_cast<int>(value.length);
+    bool lent = value.subtype == 1;
+    v8::MaybeLocal<v8::String> str;
+    if (value.type == STRING_ONE_BYTE) {
+        const char *chars = static_cast<const char *>(value.val_ptr);
+        if (lent) {
+            auto *resource = new PythonOneByteString(context, chars, length);
+            str = v8::String::NewExternalOneByte(isolate, resource);
+            if (str.IsEmpty()) {
+                resource->Dispose();
+            }
+        } else {
+            str = v8::String::NewFromOneByte(
+                isolate, reinterpret_cast<const uint8_t *>(chars),
+                v8::NewStringType::kNormal, length);
+        }
+    } else {
+        const uint16_t *chars = static_cast<const uint16_t *>(value.val_ptr);
+        if (lent) {
+            auto *resource = new PythonTwoByteString(context, chars, length);
+            str = v8::String::NewExternalTwoByte(isolate, resource);
+            if (str.IsEmpty()) {
+                resource->Dispose();
+            }
+        } else {
+            str = v8::String::NewFromTwoByte(
+                isolate, chars, v8::NewStringType::kNormal, length);
+        }
+    }
+    v8::Local<v8::String> result;
+    if (!str.ToLocal(&result)) {
+        std::cerr << "PYTHONODEJS: String too long." << std::endl;
+        return v8::String::Empty(isolate);
+    }
+    return result;
+}
+
+// Object keys coming back with their id, or already seen under another one,
+// reuse the interned V8 string. New keys are created internalized, as V8
+// would do when setting the property, and interned.
+static v8::Local<v8::String> v8_key(NodeContext *context,
+                                    const NodeValue &key) {
+    KeyTable &keys = context->keys;
+    Isolate *isolate = context->isolate;
+    if (key.subtype != 0 && key.subtype <= keys.strings.size()) {
+        return keys.strings[key.subtype - 1].Get(isolate);
+    }
+    if (key.val_string == nullptr) {
+        return v8::String::Empty(isolate);
+    }
+    std::string_view name(key.val_string, key.length);
+    auto it = keys.ids.find(name);
+    if (it != keys.ids.end()) {
+        return keys.strings[it->second - 1].Get(isolate);
+    }
+    v8::Local<v8::String> str =
+        v8::String::NewFromUtf8(isolate, key.val_string,
+                                v8::NewStringType::kInternalized,
+                                static_cast<int>(key.length))
+            .ToLocalChecked();
+    if (!keys.full()) {
+        keys.add(isolate, str, std::string(name));
+    }
+    return str;
+}
+
 v8::Local<v8::Value> to_v8_value(NodeContext *context,
                                  v8::Local<Context> local_ctx,
-                                 NodeValue value) {
+                                 const NodeValue &value) {
+    Isolate *isolate = context->isolate;
     if (value.type == UNDEFINED) {
-        return v8::Undefined(context->isolate);
+        return v8::Undefined(isolate);
     } else if (value.type == NULL_T) {
-        return v8::Null(context->isolate);
+        return v8::Null(isolate);
     } else if (value.type == NUMBER) {
-        return v8::Number::New(context->isolate, value.val_num);
+        return v8::Number::New(isolate, value.val_num);
     } else if (value.type == BOOLEAN_T) {
-        return v8::Boolean::New(context->isolate, value.val_bool);
+        return v8::Boolean::New(isolate, value.val_bool);
     } else if (value.type == STRING) {
-        return v8::String::NewFromUtf8(context->isolate, value.val_string)
-            .ToLocalChecked();
-    } else if (value.type == SYMBOL) {
-        return static_cast<v8::Global<v8::Value> *>(value.val_external_ptr)
-            ->Get(context->isolate);
-    } else if (value.type == BIGINT) {
-        int sign_bit = 0;
-        std::string s = value.val_big;
-
-        if (s.empty()) {
-            std::cerr << "PYTHONODEJS: Empty bigint value." << std::endl;
-            return {};
+        return v8_string(isolate, value);
+    } else if (value.type == STRING_ONE_BYTE ||
+               value.type == STRING_TWO_BYTE) {
+        return v8_text(context, value);
+    } else if (value.type == JSON_T) {
+        v8::Local<Value> parsed;
+        if (!v8::JSON::Parse(local_ctx, v8_string(isolate, value))
+                 .ToLocal(&parsed)) {
+            std::cerr << "PYTHONODEJS: Invalid JSON argument." << std::endl;
+            return v8::Undefined(isolate);
         }
-
-        if (s[0] == '-') {
-            sign_bit = 1;
+        return parsed;
+    } else if (value.type == SERIALIZED) {
+        v8::ValueDeserializer deserializer(
+            isolate, static_cast<const uint8_t *>(value.val_ptr), value.length);
+        v8::Local<Value> cloned;
+        if (!deserializer.ReadHeader(local_ctx).FromMaybe(false) ||
+            !deserializer.ReadValue(local_ctx).ToLocal(&cloned)) {
+            std::cerr << "PYTHONODEJS: Invalid serialized argument."
+                      << std::endl;
+            return v8::Undefined(isolate);
         }
-        s = s.substr(1);
-
-        std::vector<uint8_t> digits;
-        for (char c : s) {
-            if (c < '0' || c > '9') {
-                std::cerr << "PYTHONODEJS: Invalid digit in bigint."
-                          << std::endl;
-                return {};
-            }
-            digits.push_back(c - '0');
+        return cloned;
+    } else if (value.type == SYMBOL || value.type == FUNCTION ||
+               value.type == LAZY_OBJECT || value.type == LAZY_ARRAY) {
+        HandleTable::Slot *handle = handle_slot(context, value);
+        if (handle == nullptr) {
+            return v8::Undefined(isolate);
         }
-
-        std::vector<uint64_t> words;
-        const __uint128_t BASE = (__uint128_t)1 << 64;
-
-        while (!digits.empty()) {
-            __uint128_t value = 0;
-            std::vector<uint8_t> next;
-
-            for (size_t i = 0; i < digits.size(); ++i) {
-                value = value * 10 + digits[i];
-                if (!next.empty() || value >= BASE) {
-                    next.push_back(static_cast<uint8_t>(value / BASE));
-                    value %= BASE;
-                } else if (!next.empty()) {
-                    next.push_back(0);
-                }
+        return handle->value.Get(isolate);
+    } else if (value.type == BIGINT) {
+        if (value.length == 0) {
+            return v8::BigInt::New(isolate, value.val_int);
+        }
+        // Copied, the words lent by Python are not necessarily aligned.
+        std::vector<uint64_t> words(value.length);
+        memcpy(words.data(), value.val_ptr, value.length * sizeof(uint64_t));
+        v8::Local<v8::BigInt> bigint;
+        if (!v8::BigInt::NewFromWords(local_ctx, value.subtype,
+                                      static_cast<int>(words.size()),
+                                      words.data())
+                 .ToLocal(&bigint)) {
+            std::cerr << "PYTHONODEJS: BigInt too large." << std::endl;
+            return {};
+        }
+        return bigint;
+    } else if (value.type == ARRAY || value.type == SET) {
+        if (value.type == SET) {
+            v8::Local<v8::Set> set = v8::Set::New(isolate);
+            for (uint32_t i = 0; i < value.length; ++i) {
+                set = set->Add(local_ctx, to_v8_value(context, local_ctx,
+                                                      value.val_children[i]))
+                          .ToLocalChecked();
             }
-
-            words.push_back(static_cast<uint64_t>(value));
-            digits = next;
+            return set;
         }
-
-        return v8::BigInt::NewFromWords(local_ctx, sign_bit,
-                                        static_cast<int>(words.size()),
-                                        words.data())
-            .ToLocalChecked();
-    } else if (value.type == FUNCTION) {
-        return (*value.function).function.Get(context->isolate);
-    } else if (value.type == ARRAY) {
-        v8::Local<v8::Array> array =
-            v8::Array::New(context->isolate, value.val_array_len);
-        for (int i = 0; i < value.val_array_len; i++) {
+        v8::Local<v8::Array> array = v8::Array::New(isolate, value.length);
+        for (uint32_t i = 0; i < value.length; i++) {
             v8::Local<v8::Value> elem =
-                to_v8_value(context, local_ctx, value.val_array[i]);
+                to_v8_value(context, local_ctx, value.val_children[i]);
             if (elem.IsEmpty()) {
                 std::cerr << "PYTHONODEJS: to_v8_value returned empty for "
                              "array index "
                           << i << std::endl;
-                // Decide: skip or insert `undefined` explicitly
                 continue;
             }
-            // Now we know `elem` is real:
             array->Set(local_ctx, i, elem).Check();
         }
-
         return array;
-    } else if (value.type == ARRAY_BUFFER) {
-        auto backing_store = v8::ArrayBuffer::NewBackingStore(
-            value.val_tarray, value.val_array_len,
-            [](void *data, size_t length, void *deleter_data) {}, nullptr);
-
-        return v8::ArrayBuffer::New(context->isolate, std::move(backing_store));
-    } else if (value.type == TYPED_ARRAY) {
-        size_t element_size = 0;
-        switch (value.val_tarray_type) {
-        case INT8_T:
-            element_size = 1;
-            break;
-        case UINT8_T:
-            element_size = 1;
-            break;
-        case INT16_T:
-            element_size = 2;
-            break;
-        case UINT16_T:
-            element_size = 2;
-            break;
-        case INT32_T:
-            element_size = 4;
-            break;
-        case UINT32_T:
-            element_size = 4;
-            break;
-        case BINT64_T:
-            element_size = 8;
-            break;
-        case BUINT64_T:
-            element_size = 8;
-            break;
-        case FLOAT32_T:
-            element_size = 4;
-            break;
-        case FLOAT64_T:
-            element_size = 8;
-            break;
-        default:
-            return v8::Local<v8::TypedArray>();
+    } else if (value.type == SHARED_ARRAY_BUFFER) {
+        // Same lending as below, Python keeps the memory until V8 drops it.
+        std::unique_ptr<v8::BackingStore> backing_store;
+        if (value.length && value.val_ptr != nullptr) {
+            backing_store = v8::SharedArrayBuffer::NewBackingStore(
+                value.val_ptr, value.length, release_python_buffer, context);
+        } else {
+            backing_store = v8::SharedArrayBuffer::NewBackingStore(isolate, 0);
+        }
+        return v8::SharedArrayBuffer::New(isolate, std::move(backing_store));
+    } else if (value.type == ARRAY_BUFFER || value.type == TYPED_ARRAY) {
+        size_t element_size = 1;
+        if (value.type == TYPED_ARRAY) {
+            element_size = typed_array_element_size(
+                static_cast<TypedArrayType>(value.subtype));
+            if (element_size == 0) {
+                return v8::Local<v8::TypedArray>();
+            }
         }
 
-        size_t length_elements = value.val_array_len / element_size;
-
-        auto backing_store = v8::ArrayBuffer::NewBackingStore(
-            value.val_tarray, value.val_array_len,
-            [](void *data, size_t length, void *deleter_data) {
-                // Optional deleter or no-op
-            },
-            nullptr);
-
+        // The memory is lent by Python and used in place, V8 accounts for it
+        // as external memory of the ArrayBuffer.
+        std::unique_ptr<v8::BackingStore> backing_store;
+        if (value.length && value.val_ptr != nullptr) {
+            backing_store = v8::ArrayBuffer::NewBackingStore(
+                value.val_ptr, value.length, release_python_buffer, context);
+        } else {
+            backing_store = v8::ArrayBuffer::NewBackingStore(isolate, 0);
+        }
         v8::Local<v8::ArrayBuffer> array_buffer =
-            v8::ArrayBuffer::New(context->isolate, std::move(backing_store));
+            v8::ArrayBuffer::New(isolate, std::move(backing_store));
+        if (value.type == ARRAY_BUFFER) {
+            return array_buffer;
+        }
 
-        v8::Local<v8::TypedArray> typed_array;
-        switch (value.val_tarray_type) {
+        size_t length_elements = value.length / element_size;
+        switch (static_cast<TypedArrayType>(value.subtype)) {
         case INT8_T:
-            typed_array = v8::Int8Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Int8Array::New(array_buffer, 0, length_elements);
         case UINT8_T:
-            typed_array = v8::Uint8Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Uint8Array::New(array_buffer, 0, length_elements);
         case INT16_T:
-            typed_array = v8::Int16Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Int16Array::New(array_buffer, 0, length_elements);
         case UINT16_T:
-            typed_array =
-                v8::Uint16Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Uint16Array::New(array_buffer, 0, length_elements);
         case INT32_T:
-            typed_array = v8::Int32Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Int32Array::New(array_buffer, 0, length_elements);
         case UINT32_T:
-            typed_array =
-                v8::Uint32Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Uint32Array::New(array_buffer, 0, length_elements);
         case BINT64_T:
-            typed_array =
-                v8::BigInt64Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::BigInt64Array::New(array_buffer, 0, length_elements);
         case BUINT64_T:
-            typed_array =
-                v8::BigUint64Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::BigUint64Array::New(array_buffer, 0, length_elements);
         case FLOAT32_T:
-            typed_array =
-                v8::Float32Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Float32Array::New(array_buffer, 0, length_elements);
         case FLOAT64_T:
-            typed_array =
-                v8::Float64Array::New(array_buffer, 0, length_elements);
-            break;
+            return v8::Float64Array::New(array_buffer, 0, length_elements);
         }
-        return typed_array;
+        return v8::Local<v8::TypedArray>();
     } else if (value.type == OBJECT) {
-        v8::Local<v8::Object> object = v8::Object::New(context->isolate);
-        for (int i = 0; i < value.object_len; i++) {
-            v8::Local<v8::String> key =
-                v8::String::NewFromUtf8(context->isolate, value.object_keys[i])
-                    .ToLocalChecked();
+        v8::Local<v8::Object> object = v8::Object::New(isolate);
+        for (uint32_t i = 0; i < value.length; i++) {
+            const NodeValue &key = value.val_children[i * 2];
             v8::Local<v8::Value> val =
-                to_v8_value(context, local_ctx, value.object_values[i]);
+                to_v8_value(context, local_ctx, value.val_children[i * 2 + 1]);
 
             if (val.IsEmpty()) {
                 std::cerr << "PYTHONODEJS: to_v8_value returned empty handle "
@@ -833,84 +1698,95 @@ v8::Local<v8::Value> to_v8_value(NodeContext *context,
                 continue;
             }
 
-            v8::Maybe<bool> maybe_result = object->Set(local_ctx, key, val);
+            v8::Maybe<bool> maybe_result =
+                object->Set(local_ctx, v8_key(context, key), val);
             if (maybe_result.IsNothing()) {
                 std::cerr << "PYTHONODEJS: Failed to set key "
-                          << value.object_keys[i] << std::endl;
+                          << std::string(key.val_string, key.length)
+                          << std::endl;
             }
         }
         return object;
     } else if (value.type == DATE_T) {
-        return v8::Date::New(local_ctx, value.val_date_unix).ToLocalChecked();
+        return v8::Date::New(local_ctx, value.val_num).ToLocalChecked();
     } else if (value.type == REGEXP) {
-        v8::Local<v8::String> pattern_str =
-            v8::String::NewFromUtf8(context->isolate, value.val_string)
-                .ToLocalChecked();
-        return v8::RegExp::New(
-                   local_ctx, pattern_str,
-                   static_cast<v8::RegExp::Flags>(value.val_regex_flags))
+        return v8::RegExp::New(local_ctx, v8_string(isolate, value),
+                               static_cast<v8::RegExp::Flags>(value.subtype))
             .ToLocalChecked();
     } else if (value.type == MAP) {
-        v8::Local<v8::Map> map = v8::Map::New(context->isolate);
-        for (uint32_t i = 0; i < value.object_len; ++i) {
+        v8::Local<v8::Map> map = v8::Map::New(isolate);
+        for (uint32_t i = 0; i < value.length; ++i) {
             map = map->Set(local_ctx,
-                           to_v8_value(context, local_ctx, value.map_keys[i]),
                            to_v8_value(context, local_ctx,
-                                       value.object_values[i]))
+                                       value.val_children[i * 2]),
+                           to_v8_value(context, local_ctx,
+                                       value.val_children[i * 2 + 1]))
                       .ToLocalChecked();
         }
         return map;
-    } else if (value.type == SET) {
-        v8::Local<v8::Set> set = v8::Set::New(context->isolate);
-        for (uint32_t i = 0; i < value.object_len; ++i) {
-            set = set->Add(local_ctx,
-                           to_v8_value(context, local_ctx, value.val_array[i]))
-                      .ToLocalChecked();
-        }
-        return set;
+    } else if (value.type == ERROR_T) {
+        v8::Local<v8::Value> error =
+            v8::Exception::Error(v8_string(isolate, value.val_children[0]));
+        error.As<v8::Object>()
+            ->Set(local_ctx, v8::String::NewFromUtf8Literal(isolate, "name"),
+                  v8_string(isolate, value.val_children[1]))
+            .Check();
+        return error;
     } else if (value.type == PROXY) {
-        return v8::Proxy::New(
-                   local_ctx,
-                   to_v8_value(context, local_ctx, *value.proxy_target)
-                       .As<v8::Object>(),
-                   to_v8_value(context, local_ctx, *value.proxy_handler)
-                       .As<v8::Object>())
+        return v8::Proxy::New(local_ctx,
+                              to_v8_value(context, local_ctx,
+                                          value.val_children[0])
+                                  .As<v8::Object>(),
+                              to_v8_value(context, local_ctx,
+                                          value.val_children[1])
+                                  .As<v8::Object>())
             .ToLocalChecked();
     } else if (value.type == EXTERNAL) {
-        return v8::External::New(context->isolate, value.val_external_ptr);
-    } else if (value.type == PROMISE) {
+        return v8::External::New(isolate, value.val_ptr);
+    } else if (value.type == PROMISE && value.val_int >= 0) {
+        std::vector<v8::Global<v8::Promise::Resolver>> &resolvers =
+            context->futures.resolvers;
+        size_t id = static_cast<size_t>(value.val_int);
         v8::Local<v8::Promise::Resolver> resolver =
             v8::Promise::Resolver::New(local_ctx).ToLocalChecked();
-        v8::Global<v8::Promise::Resolver> global(context->isolate, resolver);
-        context->resolvers_from_python[value.future_id] = std::move(global);
+        if (id >= resolvers.size()) {
+            resolvers.resize(id + 1);
+        }
+        resolvers[id].Reset(isolate, resolver);
         return resolver->GetPromise();
     }
     return {};
 }
 
 void NodeContext_FutureUpdate(NodeContext *context, int64_t id,
-                              NodeValue result, bool rejected) {
-    if (context->resolvers_from_python.contains(id)) {
-        Locker locker(context->isolate);
-        Isolate::Scope isolate_scope(context->isolate);
-        HandleScope handle_scope(context->isolate);
-        v8::Local<Context> local_ctx =
-            context->global_ctx.Get(context->isolate);
-        v8::Local<v8::Promise::Resolver> resolver =
-            context->resolvers_from_python[id].Get(context->isolate);
-        if (rejected) {
-            resolver->Reject(local_ctx, to_v8_value(context, local_ctx, result))
-                .ToChecked();
-        } else {
-            resolver
-                ->Resolve(local_ctx, to_v8_value(context, local_ctx, result))
-                .ToChecked();
-        }
-        context->resolvers_from_python.erase(id);
-        run_loop_blocking(context);
+                              const NodeValue *result, bool rejected) {
+    // The JS thread grows the table while converting, read it under the lock.
+    Locker locker(context->isolate);
+    std::vector<v8::Global<v8::Promise::Resolver>> &resolvers =
+        context->futures.resolvers;
+    if (id < 0 || static_cast<size_t>(id) >= resolvers.size() ||
+        resolvers[id].IsEmpty()) {
+        std::cerr << "PYTHONODEJS: Invalid future " << id << std::endl;
         return;
     }
-    std::cerr << "PYTHONODEJS: Invalid future " << id << std::endl;
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Local<v8::Promise::Resolver> resolver =
+        resolvers[id].Get(context->isolate);
+    resolvers[id].Reset();
+    CallTiming timing(context);
+    v8::Local<Value> value = to_v8_value(context, local_ctx, *result);
+    timing.lap(PHASE_ARGS);
+    if (rejected) {
+        resolver->Reject(local_ctx, value).ToChecked();
+    } else {
+        resolver->Resolve(local_ctx, value).ToChecked();
+    }
+    timing.lap(PHASE_RUN);
+    run_loop(context);
+    timing.lap(PHASE_LOOP);
+    timing.record(TIMING_RESOLVE, "");
 }
 
 int NodeContext_Init(NodeContext *context, char **imports, int num_imports,
@@ -921,9 +1797,23 @@ int NodeContext_Init(NodeContext *context, char **imports, int num_imports,
     std::string binary_path = context->args[0];
     std::vector<std::string> filtered_args;
 
-    {
+    if (!context->snapshot_path.empty()) {
+        FILE *fp = fopen(context->snapshot_path.c_str(), "rb");
+        if (fp != nullptr) {
+            context->snapshot = node::EmbedderSnapshotData::FromFile(fp);
+            fclose(fp);
+        }
+        if (!context->snapshot) {
+            std::cerr << "PYTHONODEJS: Failed to load snapshot "
+                      << context->snapshot_path << std::endl;
+            return 1;
+        }
+        context->setup = CommonEnvironmentSetup::CreateFromSnapshot(
+            context->platform, &errors, context->snapshot.get(),
+            filtered_args, context->exec_args);
+    } else {
         context->setup =
-            CommonEnvironmentSetup::Create(context->platform.get(), &errors,
+            CommonEnvironmentSetup::Create(context->platform, &errors,
                                            filtered_args, context->exec_args);
     }
     if (!context->setup) {
@@ -941,6 +1831,16 @@ int NodeContext_Init(NodeContext *context, char **imports, int num_imports,
 
     isolate->SetData(0, context);
 
+    // Settled promises are delivered after each loop iteration, including
+    // while the loop runs for long (e.g. a server in blocking mode).
+    uv_check_init(loop, &context->futures.check);
+    context->futures.check.data = context;
+    uv_check_start(&context->futures.check, [](uv_check_t *check) {
+        deliver_futures(static_cast<NodeContext *>(check->data));
+    });
+    uv_unref(reinterpret_cast<uv_handle_t *>(&context->futures.check));
+    context->futures.check_open = true;
+
     int exit_code = 0;
     {
         Locker locker(isolate);
@@ -951,26 +1851,40 @@ int NodeContext_Init(NodeContext *context, char **imports, int num_imports,
         context->global_ctx = std::move(global_ctx);
         Context::Scope context_scope(local_ctx);
 
-        v8::Local<v8::Array> importArr =
-            v8::Array::New(context->isolate, num_imports);
-        for (int i = 0; i < num_imports; i++) {
-            importArr
-                ->Set(local_ctx, i,
-                      v8::String::NewFromUtf8(isolate, imports[i])
-                          .ToLocalChecked())
-                .Check();
-        }
+        v8::Local<v8::Function> require;
+        if (context->snapshot) {
+            // The deserialize main function of the snapshot re-creates
+            // `require` for the current directory.
+            if (node::LoadEnvironment(env, node::StartExecutionCallback{})
+                    .IsEmpty()) {
+                return 1;
+            }
+            require = local_ctx->Global()
+                          ->Get(local_ctx, v8::String::NewFromUtf8Literal(
+                                               isolate, "require"))
+                          .ToLocalChecked()
+                          .As<v8::Function>();
+        } else {
+            v8::Local<v8::Array> importArr =
+                v8::Array::New(context->isolate, num_imports);
+            for (int i = 0; i < num_imports; i++) {
+                importArr
+                    ->Set(local_ctx, i,
+                          v8::String::NewFromUtf8(isolate, imports[i])
+                              .ToLocalChecked())
+                    .Check();
+            }
 
-        local_ctx->Global()
-            ->Set(local_ctx,
-                  v8::String::NewFromUtf8Literal(isolate, "importNames"),
-                  importArr)
-            .Check();
+            local_ctx->Global()
+                ->Set(local_ctx,
+                      v8::String::NewFromUtf8Literal(isolate, "importNames"),
+                      importArr)
+                .Check();
 
-        v8::Local<v8::Function> require = v8::Local<v8::Function>::Cast(
-            node::LoadEnvironment(
-                env,
-                R"(const { createRequire } = require('module');
+            require = v8::Local<v8::Function>::Cast(
+                node::LoadEnvironment(
+                    env,
+                    R"(const { createRequire } = require('module');
                  const publicRequire = createRequire(process.cwd() + '/');
                  
 (async (names) => {
@@ -986,7 +1900,8 @@ int NodeContext_Init(NodeContext *context, char **imports, int num_imports,
   
 })(globalThis.importNames);
                  return publicRequire;)")
-                .ToLocalChecked());
+                    .ToLocalChecked());
+        }
 
         run_loop_blocking(context);
 
@@ -1016,6 +1931,96 @@ int NodeContext_Init(NodeContext *context, char **imports, int num_imports,
     return exit_code;
 }
 
+int NodeContext_Build_Snapshot(NodeContext *context, const char *path,
+                               char **modules, int num_modules,
+                               const char *warmup) {
+
+    std::vector<std::string> errors;
+
+    // args[1] names the builder script, anonymized so that no build time
+    // path ends up in the snapshot.
+    std::vector<std::string> args = {context->args[0],
+                                     node::GetAnonymousMainPath()};
+    node::SnapshotConfig config;
+    config.builder_script_path = args[1];
+
+    std::unique_ptr<CommonEnvironmentSetup> setup =
+        CommonEnvironmentSetup::CreateForSnapshotting(
+            context->platform, &errors, args, context->exec_args,
+            config);
+    if (!setup) {
+        for (const std::string &err : errors)
+            fprintf(stderr, "%s: %s\n", args[0].c_str(), err.c_str());
+        return 1;
+    }
+
+    Isolate *isolate = setup->isolate();
+    {
+        Locker locker(isolate);
+        Isolate::Scope isolate_scope(isolate);
+        HandleScope handle_scope(isolate);
+        v8::Local<Context> local_ctx = setup->context();
+        Context::Scope context_scope(local_ctx);
+
+        v8::Local<v8::Array> names = v8::Array::New(isolate, num_modules);
+        for (int i = 0; i < num_modules; i++) {
+            names
+                ->Set(local_ctx, i,
+                      v8::String::NewFromUtf8(isolate, modules[i])
+                          .ToLocalChecked())
+                .Check();
+        }
+        local_ctx->Global()
+            ->Set(local_ctx,
+                  v8::String::NewFromUtf8Literal(isolate, "snapshotModules"),
+                  names)
+            .Check();
+        local_ctx->Global()
+            ->Set(local_ctx,
+                  v8::String::NewFromUtf8Literal(isolate, "snapshotWarmup"),
+                  v8::String::NewFromUtf8(isolate, warmup ? warmup : "")
+                      .ToLocalChecked())
+            .Check();
+
+        // Preloaded modules stay in the module cache of the snapshot, the
+        // `require` of a context created from it finds them there.
+        if (node::LoadEnvironment(
+                setup->env(),
+                R"(const { createRequire } = require('module');
+const publicRequire = createRequire(process.cwd() + '/');
+for (const name of globalThis.snapshotModules) {
+  publicRequire(name);
+}
+publicRequire('vm').runInThisContext(globalThis.snapshotWarmup);
+delete globalThis.snapshotModules;
+delete globalThis.snapshotWarmup;
+require('v8').startupSnapshot.setDeserializeMainFunction(() => {
+  globalThis.require = createRequire(process.cwd() + '/');
+});)")
+                .IsEmpty() ||
+            node::SpinEventLoop(setup->env()).IsNothing()) {
+            std::cerr << "PYTHONODEJS: Snapshot builder script failed."
+                      << std::endl;
+            return 1;
+        }
+    }
+
+    node::EmbedderSnapshotData::Pointer snapshot = setup->CreateSnapshot();
+    if (!snapshot) {
+        std::cerr << "PYTHONODEJS: Failed to create snapshot." << std::endl;
+        return 1;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (fp == nullptr) {
+        std::cerr << "PYTHONODEJS: Failed to write snapshot " << path
+                  << std::endl;
+        return 1;
+    }
+    snapshot->ToFile(fp);
+    fclose(fp);
+    return 0;
+}
+
 std::string GetV8TypeAsString(v8::Isolate *isolate,
                               v8::Local<v8::Value> value) {
     v8::Local<v8::String> type_str = value->TypeOf(isolate);
@@ -1023,9 +2028,190 @@ std::string GetV8TypeAsString(v8::Isolate *isolate,
     return std::string(*utf8);
 }
 
-NodeValue NodeContext_Run_Script(NodeContext *context, const char *code) {
+// Scripts smaller than this compile faster than their cache entry loads.
+static constexpr size_t kMinCachedScript = 1024;
+
+// FNV-1a, names the code cache entry of a script.
+static uint64_t hash_source(const char *data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<uint8_t>(data[i]);
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static std::string hex(uint64_t value) {
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)value);
+    return buf;
+}
+
+// Entries live in a directory named after the V8 cache version, so that an
+// upgrade of Node starts from an empty cache instead of rejected entries. The
+// prefix marks the directories the library owns in a shared cache directory.
+static constexpr const char *kCodeCachePrefix = "pythonodejs-v8-";
+
+static std::filesystem::path code_cache_version_dir(NodeContext *context) {
+    return context->code_cache_dir /
+           (kCodeCachePrefix +
+            hex(v8::ScriptCompiler::CachedDataVersionTag()));
+}
+
+// Drops the entries of other V8 versions, leaving anything else in the
+// directory alone.
+static void sweep_code_cache(NodeContext *context) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path current = code_cache_version_dir(context);
+    for (const fs::directory_entry &entry :
+         fs::directory_iterator(context->code_cache_dir, ec)) {
+        std::string name = entry.path().filename().string();
+        if (name.rfind(kCodeCachePrefix, 0) == 0 &&
+            name.size() == strlen(kCodeCachePrefix) + 16 &&
+            entry.is_directory(ec) && entry.path() != current) {
+            fs::remove_all(entry.path(), ec);
+        }
+    }
+}
+
+static v8::ScriptCompiler::CachedData *
+read_code_cache(const std::filesystem::path &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        return nullptr;
+    }
+    std::streamsize size = file.tellg();
+    if (size <= 0) {
+        return nullptr;
+    }
+    uint8_t *data = new uint8_t[size];
+    file.seekg(0);
+    if (!file.read(reinterpret_cast<char *>(data), size)) {
+        delete[] data;
+        return nullptr;
+    }
+    // Keeps recently used entries from being evicted first.
+    std::error_code ec;
+    std::filesystem::last_write_time(
+        path, std::filesystem::file_time_type::clock::now(), ec);
+    return new v8::ScriptCompiler::CachedData(
+        data, static_cast<int>(size),
+        v8::ScriptCompiler::CachedData::BufferOwned);
+}
+
+// Drops the least recently used entries until the cache fits in its limit.
+static void trim_code_cache(NodeContext *context) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path current = code_cache_version_dir(context);
+    std::vector<std::pair<fs::file_time_type, fs::path>> entries;
+    uint64_t total = 0;
+    for (const fs::directory_entry &entry :
+         fs::directory_iterator(current, ec)) {
+        uint64_t size = entry.file_size(ec);
+        if (ec) {
+            continue;
+        }
+        total += size;
+        entries.emplace_back(entry.last_write_time(ec), entry.path());
+    }
+    std::sort(entries.begin(), entries.end());
+    for (const auto &[time, path] : entries) {
+        if (total <= context->code_cache_limit) {
+            break;
+        }
+        uint64_t size = fs::file_size(path, ec);
+        if (fs::remove(path, ec)) {
+            total -= size;
+        }
+    }
+}
+
+static void write_code_cache(NodeContext *context,
+                             const std::filesystem::path &path,
+                             const v8::ScriptCompiler::CachedData *data) {
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    // Written aside and renamed so that concurrent processes never read a
+    // partial entry.
+    std::filesystem::path tmp = path;
+    tmp += "." + hex(randomInt64()) + ".tmp";
+    {
+        std::ofstream file(tmp, std::ios::binary | std::ios::trunc);
+        if (!file.write(reinterpret_cast<const char *>(data->data),
+                        data->length)) {
+            file.close();
+            std::filesystem::remove(tmp, ec);
+            return;
+        }
+    }
+    std::filesystem::rename(tmp, path, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        return;
+    }
+    trim_code_cache(context);
+}
+
+// Compiles and runs a script like vm.runInThisContext, going through the code
+// cache. Scripts already compiled by this isolate are left to V8's in-memory
+// compilation cache.
+static v8::MaybeLocal<Value> run_cached_script(NodeContext *context,
+                                               v8::Local<Context> local_ctx,
+                                               const char *code) {
+    Isolate *isolate = context->isolate;
+    size_t length = strlen(code);
+    v8::Local<v8::String> source_text;
+    if (!v8::String::NewFromUtf8(isolate, code, v8::NewStringType::kNormal,
+                                 static_cast<int>(length))
+             .ToLocal(&source_text)) {
+        return {};
+    }
+    v8::ScriptOrigin origin(
+        v8::String::NewFromUtf8Literal(isolate, "evalmachine.<anonymous>"));
+
+    uint64_t hash = hash_source(code, length);
+    std::filesystem::path path =
+        code_cache_version_dir(context) / (hex(hash) + ".bin");
+    bool first = context->code_cache_seen.insert(hash).second;
+
+    // The source takes ownership of the cached data.
+    v8::ScriptCompiler::CachedData *cached =
+        first ? read_code_cache(path) : nullptr;
+    v8::ScriptCompiler::Source source(source_text, origin, cached);
+    v8::Local<v8::Script> script;
+    if (!v8::ScriptCompiler::Compile(
+             local_ctx, &source,
+             cached ? v8::ScriptCompiler::kConsumeCodeCache
+                    : v8::ScriptCompiler::kNoCompileOptions)
+             .ToLocal(&script)) {
+        return {};
+    }
+    bool produce = first && (cached == nullptr || cached->rejected);
+
+    v8::MaybeLocal<Value> result = script->Run(local_ctx);
+
+    if (produce) {
+        // Created after the run so that functions compiled lazily by the top
+        // level code are part of the cache too.
+        std::unique_ptr<v8::ScriptCompiler::CachedData> data(
+            v8::ScriptCompiler::CreateCodeCache(script->GetUnboundScript()));
+        if (data) {
+            write_code_cache(context, path, data.get());
+        }
+    }
+    return result;
+}
+
+NodeResult *NodeContext_Run_Script(NodeContext *context, const char *code) {
+    return NodeContext_Run_Script_As(context, code, TRANSFER_TREE);
+}
+
+NodeResult *NodeContext_Run_Script_As(NodeContext *context, const char *code,
+                                      int transfer) {
 
-    NodeValue nv_res = {};
+    NodeResult *res = new_result();
 
     {
         Locker locker(context->isolate);
@@ -1035,23 +2221,43 @@ NodeValue NodeContext_Run_Script(NodeContext *context, const char *code) {
             context->global_ctx.Get(context->isolate);
         Context::Scope context_scope(local_ctx);
 
-        v8::Local<Value> s[] = {
-            v8::String::NewFromUtf8(context->isolate, code).ToLocalChecked(),
-        };
-        v8::Local<v8::Value> result =
-            context->runInThisContext.Get(context->isolate)
-                ->Call(context->isolate, local_ctx, local_ctx->Global(), 1, s)
-                .ToLocalChecked();
+        CallTiming timing(context);
+        v8::Local<v8::Value> result;
+        if (!context->code_cache_dir.empty() &&
+            strlen(code) >= kMinCachedScript) {
+            if (!run_cached_script(context, local_ctx, code)
+                     .ToLocal(&result)) {
+                result = v8::Undefined(context->isolate);
+            }
+        } else {
+            v8::Local<Value> s[] = {
+                v8::String::NewFromUtf8(context->isolate, code)
+                    .ToLocalChecked(),
+            };
+            // A thrown script is reported by Node like an uncaught exception
+            // and gives undefined, as with the code cache and calls.
+            if (!context->runInThisContext.Get(context->isolate)
+                     ->Call(context->isolate, local_ctx, local_ctx->Global(),
+                            1, s)
+                     .ToLocal(&result)) {
+                result = v8::Undefined(context->isolate);
+            }
+        }
 
         // v8::Local<v8::Value> result =
         //     node::LoadEnvironment(context->env, code).ToLocalChecked();
+        timing.lap(PHASE_RUN);
 
-        nv_res = to_node_value(context, local_ctx, result);
+        res->value =
+            transfer_value(context, *res->arena, local_ctx, result, transfer);
+        timing.lap(PHASE_RESULT);
 
-        run_loop_blocking(context);
+        run_loop(context);
+        timing.lap(PHASE_LOOP);
+        timing.record(TIMING_SCRIPT, "");
     }
 
-    return nv_res;
+    return res;
 }
 
 void js_function_callback(const v8::FunctionCallbackInfo<v8::Value> &args) {
@@ -1066,23 +2272,31 @@ void js_function_callback(const v8::FunctionCallbackInfo<v8::Value> &args) {
     v8::Local<Context> local_ctx = info->context->global_ctx.Get(isolate);
 
     void *result = nullptr;
+    CallTiming timing(info->context);
 
     if (args.Length() == 0) {
         result = info->context->py_callback(info->name, NULL, 0);
+        timing.lap(PHASE_RUN);
     } else {
-        NodeValue *arr = (NodeValue *)malloc(args.Length() * sizeof(NodeValue));
+        // The arguments only need to outlive the Python callback.
+        NodeArena arena;
+        NodeValue *arr = arena.values(args.Length());
 
         for (int i = 0; i < args.Length(); i++) {
             v8::Local<v8::Value> arg = args[i];
-            arr[i] = to_node_value(info->context, local_ctx, arg);
+            arr[i] = to_node_value(info->context, arena, local_ctx, arg);
         }
+        timing.lap(PHASE_RESULT);
 
         result = info->context->py_callback(info->name, arr, args.Length());
+        timing.lap(PHASE_RUN);
     }
     if (result != nullptr) {
         args.GetReturnValue().Set(
             to_v8_value(info->context, local_ctx, *((NodeValue *)result)));
+        timing.lap(PHASE_ARGS);
     }
+    timing.record(TIMING_CALLBACK, info->name);
 }
 
 NodeValue NodeContext_Create_Function(NodeContext *context,
@@ -1110,11 +2324,21 @@ NodeValue NodeContext_Create_Function(NodeContext *context,
               fn)
         .Check();
 
-    return to_node_value(context, local_ctx, fn);
+    // Functions convert to a handle, so nothing is left in the arena.
+    NodeArena arena;
+    return to_node_value(context, arena, local_ctx, fn);
 }
 
-NodeValue NodeContext_Call_Function(NodeContext *context, NodeValue function,
-                                    NodeValue *args, size_t args_length) {
+NodeResult *NodeContext_Call_Function(NodeContext *context,
+                                      NodeValue function, NodeValue *args,
+                                      size_t args_length) {
+    return NodeContext_Call_Function_As(context, function, args, args_length,
+                                        TRANSFER_TREE);
+}
+
+NodeResult *NodeContext_Call_Function_As(NodeContext *context,
+                                         NodeValue function, NodeValue *args,
+                                         size_t args_length, int transfer) {
 
     Locker locker(context->isolate);
     Isolate::Scope isolate_scope(context->isolate);
@@ -1122,137 +2346,1137 @@ NodeValue NodeContext_Call_Function(NodeContext *context, NodeValue function,
     v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
     v8::Context::Scope context_scope(local_ctx);
 
-    v8::Local<v8::Value> *args_arr = new v8::Local<v8::Value>[args_length];
+    CallTiming timing(context);
+    std::vector<v8::Local<v8::Value>> args_arr(args_length);
     for (size_t i = 0; i < args_length; i++) {
-        auto v = to_v8_value(context, local_ctx, args[i]);
-        args_arr[i] = v;
+        args_arr[i] = to_v8_value(context, local_ctx, args[i]);
     }
+    timing.lap(PHASE_ARGS);
 
+    HandleTable::Slot *handle = handle_slot(context, function);
+    if (handle == nullptr) {
+        return new_result();
+    }
     v8::Local<v8::Function> func =
-        function.function->function.Get(context->isolate);
+        handle->value.Get(context->isolate).As<v8::Function>();
 
     v8::Local<Value> recv = local_ctx->Global();
-    if (function.parent != nullptr) {
-        recv = ((Val *)function.parent)->value.Get(context->isolate);
+    if (!handle->recv.IsEmpty()) {
+        recv = handle->recv.Get(context->isolate);
     }
 
     v8::MaybeLocal<v8::Value> maybe_result =
         func->Call(local_ctx, // <— no Isolate* here
-                   recv, static_cast<int>(args_length), args_arr);
-    run_loop_blocking(context);
-
-    if (maybe_result.IsEmpty()) {
-        return {};
+                   recv, static_cast<int>(args_length), args_arr.data());
+    timing.lap(PHASE_RUN);
+    run_loop(context);
+    timing.lap(PHASE_LOOP);
+
+    NodeResult *res = new_result();
+    if (!maybe_result.IsEmpty()) {
+        res->value = transfer_value(context, *res->arena, local_ctx,
+                                    maybe_result.ToLocalChecked(), transfer);
     }
+    timing.lap(PHASE_RESULT);
+    timing.record(TIMING_CALL, handle->name);
+    return res;
+}
 
-    return to_node_value(context, local_ctx, maybe_result.ToLocalChecked());
+// A value thrown by JS as an ERROR_T. Error objects convert as when they are
+// returned, anything else thrown becomes the message.
+static NodeValue thrown_value(NodeContext *context, NodeArena &arena,
+                              v8::Local<Context> local_ctx,
+                              v8::Local<Value> exception) {
+    if (exception->IsNativeError()) {
+        return to_node_value(context, arena, local_ctx, exception);
+    }
+    Isolate *isolate = context->isolate;
+    NodeValue *fields = arena.values(3);
+    fields[0] = string_value(arena, isolate, local_ctx, exception);
+    fields[1] = string_value(arena, isolate, local_ctx,
+                             v8::String::NewFromUtf8Literal(isolate, "Error"));
+    fields[2] = string_value(arena, isolate, local_ctx,
+                             v8::String::Empty(isolate));
+    return {.type = ERROR_T, .length = 3, .val_children = fields};
 }
 
-void NodeContext_Define_Global(NodeContext *context, const char **keys,
-                               NodeValue *values, int length) {
+NodeResult *NodeContext_Map_Function(NodeContext *context,
+                                     NodeValue function, NodeValue *rows,
+                                     size_t num_rows) {
 
     Locker locker(context->isolate);
     Isolate::Scope isolate_scope(context->isolate);
     HandleScope handle_scope(context->isolate);
     v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
     v8::Context::Scope context_scope(local_ctx);
-    for (int i = 0; i < length; i++) {
-        local_ctx->Global()
-            ->Set(local_ctx,
-                  v8::String::NewFromUtf8(context->isolate, keys[i])
-                      .ToLocalChecked(),
+
+    CallTiming timing(context);
+    HandleTable::Slot *handle = handle_slot(context, function);
+    if (handle == nullptr) {
+        return new_result();
+    }
+    v8::Local<v8::Function> func =
+        handle->value.Get(context->isolate).As<v8::Function>();
+
+    v8::Local<Value> recv = local_ctx->Global();
+    if (!handle->recv.IsEmpty()) {
+        recv = handle->recv.Get(context->isolate);
+    }
+
+    std::vector<v8::Local<v8::Value>> results(num_rows);
+    std::vector<bool> thrown(num_rows);
+    std::vector<v8::Local<v8::Value>> args_arr;
+    for (size_t i = 0; i < num_rows; i++) {
+        // Argument handles of a call are freed before the next one.
+        v8::EscapableHandleScope call_scope(context->isolate);
+        const NodeValue &row = rows[i];
+        args_arr.resize(row.length);
+        for (uint32_t j = 0; j < row.length; j++) {
+            args_arr[j] = to_v8_value(context, local_ctx, row.val_children[j]);
+        }
+        timing.lap(PHASE_ARGS);
+        // A row that throws gives its error, the other rows still run.
+        v8::TryCatch try_catch(context->isolate);
+        v8::Local<v8::Value> result;
+        if (func->Call(local_ctx, recv, static_cast<int>(row.length),
+                       args_arr.data())
+                .ToLocal(&result)) {
+            results[i] = call_scope.Escape(result);
+        } else if (try_catch.HasCaught() && !try_catch.Exception().IsEmpty()) {
+            results[i] = call_scope.Escape(try_catch.Exception());
+            thrown[i] = true;
+        }
+        timing.lap(PHASE_RUN);
+    }
+    // Settles what the calls left pending once for the whole batch.
+    run_loop(context);
+    timing.lap(PHASE_LOOP);
+
+    NodeResult *res = new_result();
+    NodeValue *values = res->arena->values(num_rows);
+    for (size_t i = 0; i < num_rows; i++) {
+        if (thrown[i]) {
+            values[i] =
+                thrown_value(context, *res->arena, local_ctx, results[i]);
+        } else if (!results[i].IsEmpty()) {
+            values[i] =
+                to_node_value(context, *res->arena, local_ctx, results[i]);
+        }
+    }
+    res->value = {.type = ARRAY,
+                  .length = static_cast<uint32_t>(num_rows),
+                  .val_children = values};
+    timing.lap(PHASE_RESULT);
+    timing.record(TIMING_CALL, handle->name);
+    return res;
+}
+
+// Returns the child converted with the same rules as eager results, with the
+// object kept as receiver so that methods can be called on it.
+static NodeResult *lazy_child(NodeContext *context,
+                              v8::Local<Context> local_ctx,
+                              v8::Local<v8::Object> object,
+                              v8::MaybeLocal<v8::Value> maybe_child) {
+    NodeResult *res = new_result();
+    v8::Local<v8::Value> child;
+    if (maybe_child.ToLocal(&child)) {
+        res->value =
+            to_node_value(context, *res->arena, local_ctx, child, object);
+    }
+    return res;
+}
+
+static bool lazy_object(NodeContext *context, NodeValue value,
+                        v8::Local<v8::Object> *out) {
+    if (value.type != LAZY_OBJECT && value.type != LAZY_ARRAY) {
+        std::cerr << "PYTHONODEJS: Expected a lazy object handle." << std::endl;
+        return false;
+    }
+    HandleTable::Slot *handle = handle_slot(context, value);
+    if (handle == nullptr) {
+        return false;
+    }
+    *out = handle->value.Get(context->isolate).As<v8::Object>();
+    return true;
+}
+
+NodeResult *NodeContext_Get_Property(NodeContext *context, NodeValue object,
+                                     const char *key) {
+
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Context::Scope context_scope(local_ctx);
+
+    v8::Local<v8::Object> obj;
+    if (!lazy_object(context, object, &obj)) {
+        return new_result();
+    }
+    v8::Local<v8::String> name;
+    if (!v8::String::NewFromUtf8(context->isolate, key).ToLocal(&name)) {
+        return new_result();
+    }
+    return lazy_child(context, local_ctx, obj, obj->Get(local_ctx, name));
+}
+
+NodeResult *NodeContext_Get_Index(NodeContext *context, NodeValue object,
+                                  int index) {
+
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Context::Scope context_scope(local_ctx);
+
+    v8::Local<v8::Object> obj;
+    if (!lazy_object(context, object, &obj) || index < 0) {
+        return new_result();
+    }
+    return lazy_child(context, local_ctx, obj,
+                      obj->Get(local_ctx, static_cast<uint32_t>(index)));
+}
+
+int NodeContext_Get_Length(NodeContext *context, NodeValue object) {
+
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Context::Scope context_scope(local_ctx);
+
+    v8::Local<v8::Object> obj;
+    if (!lazy_object(context, object, &obj)) {
+        return 0;
+    }
+    if (obj->IsArray()) {
+        return static_cast<int>(obj.As<v8::Array>()->Length());
+    }
+    v8::Local<v8::Array> keys;
+    if (!obj->GetOwnPropertyNames(local_ctx).ToLocal(&keys)) {
+        return 0;
+    }
+    return static_cast<int>(keys->Length());
+}
+
+NodeResult *NodeContext_Get_Keys(NodeContext *context, NodeValue object) {
+
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Context::Scope context_scope(local_ctx);
+
+    v8::Local<v8::Object> obj;
+    v8::Local<v8::Array> keys;
+    if (!lazy_object(context, object, &obj) ||
+        !obj->GetOwnPropertyNames(local_ctx).ToLocal(&keys)) {
+        return new_result();
+    }
+
+    NodeResult *res = new_result();
+    uint32_t length = keys->Length();
+    NodeValue *arr = res->arena->values(length);
+    for (uint32_t i = 0; i < length; i++) {
+        arr[i] = key_value(context, *res->arena, local_ctx,
+                           keys->Get(local_ctx, i).ToLocalChecked());
+    }
+    res->value = {.type = ARRAY, .length = length, .val_children = arr};
+    return res;
+}
+
+void NodeContext_Define_Global(NodeContext *context, const char **keys,
+                               NodeValue *values, int length) {
+
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Context::Scope context_scope(local_ctx);
+    for (int i = 0; i < length; i++) {
+        local_ctx->Global()
+            ->Set(local_ctx,
+                  v8::String::NewFromUtf8(context->isolate, keys[i])
+                      .ToLocalChecked(),
                   to_v8_value(context, local_ctx, values[i]))
             .Check();
     }
 }
 
-NodeValue NodeContext_Construct_Function(NodeContext *context,
-                                         NodeValue function, NodeValue *args,
-                                         size_t args_length) {
+NodeResult *NodeContext_Construct_Function(NodeContext *context,
+                                           NodeValue function, NodeValue *args,
+                                           size_t args_length) {
 
     Locker locker(context->isolate);
     Isolate::Scope isolate_scope(context->isolate);
     HandleScope handle_scope(context->isolate);
     v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
     v8::Context::Scope context_scope(local_ctx);
-    std::vector<v8::Local<v8::Value>> args_vec = {};
-    for (int i = 0; i < args_length; i++) {
-        args_vec.push_back(to_v8_value(context, local_ctx, args[i]));
+    CallTiming timing(context);
+    std::vector<v8::Local<v8::Value>> args_vec(args_length);
+    for (size_t i = 0; i < args_length; i++) {
+        args_vec[i] = to_v8_value(context, local_ctx, args[i]);
+    }
+    timing.lap(PHASE_ARGS);
+    HandleTable::Slot *handle = handle_slot(context, function);
+    if (handle == nullptr) {
+        return new_result();
     }
     v8::Local<v8::Function> func =
-        function.function->function.Get(context->isolate);
+        handle->value.Get(context->isolate).As<v8::Function>();
 
-    v8::Local<v8::Value> result =
-        func->NewInstance(local_ctx, args_length, args_vec.data())
-            .ToLocalChecked();
+    // A constructor that throws gives undefined, as a function call does.
+    v8::MaybeLocal<v8::Object> maybe_result = func->NewInstance(
+        local_ctx, static_cast<int>(args_length), args_vec.data());
+    timing.lap(PHASE_RUN);
+
+    run_loop(context);
+    timing.lap(PHASE_LOOP);
+
+    NodeResult *res = new_result();
+    v8::Local<v8::Object> result;
+    if (maybe_result.ToLocal(&result)) {
+        res->value = to_node_value(context, *res->arena, local_ctx, result);
+    }
+    timing.lap(PHASE_RESULT);
+    timing.record(TIMING_CONSTRUCT, handle->name);
+    return res;
+}
+
+void NodeContext_SetNonBlocking(NodeContext *context, bool nonblocking) {
+    context->nonblocking = nonblocking;
+}
+
+int NodeContext_Backend_Fd(NodeContext *context) {
+    return uv_backend_fd(context->loop);
+}
+
+int NodeContext_Backend_Timeout(NodeContext *context) {
+    return uv_backend_timeout(context->loop);
+}
 
-    run_loop_blocking(context);
+bool NodeContext_Tick(NodeContext *context) {
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    v8::Local<Context> local_ctx = context->global_ctx.Get(context->isolate);
+    v8::Context::Scope context_scope(local_ctx);
 
-    return to_node_value(context, local_ctx, result);
+    uv_run(context->loop, UV_RUN_NOWAIT);
+    deliver_futures(context);
+    context->handles.collect();
+    return uv_loop_alive(context->loop);
+}
+
+void NodeContext_SetCompletionCallback(NodeContext *context,
+                                       CompletionCallback cb) {
+    context->completion_callback = cb;
+}
+
+static void run_command(NodeContext *context, Command *command) {
+    NodeResult *result = nullptr;
+    switch (command->kind) {
+    case Command::SCRIPT:
+        result = NodeContext_Run_Script_As(context, command->code.c_str(),
+                                           command->transfer);
+        break;
+    case Command::CALL:
+        result = NodeContext_Call_Function_As(context, command->function,
+                                              command->args,
+                                              command->args_length,
+                                              command->transfer);
+        break;
+    case Command::CONSTRUCT:
+        result = NodeContext_Construct_Function(
+            context, command->function, command->args, command->args_length);
+        break;
+    case Command::MAP:
+        result = NodeContext_Map_Function(context, command->function,
+                                          command->args, command->args_length);
+        break;
+    case Command::DEFINE:
+        NodeContext_Define_Global(context, command->keys, command->args,
+                                  static_cast<int>(command->args_length));
+        result = new_result();
+        break;
+    case Command::PROFILE_START:
+    case Command::PROFILE_STOP: {
+        int error = command->kind == Command::PROFILE_START
+                        ? NodeContext_Profile_Start(context,
+                                                    command->sampling_interval)
+                        : NodeContext_Profile_Stop(
+                              context, command->code.c_str(),
+                              command->collapsed_path.empty()
+                                  ? nullptr
+                                  : command->collapsed_path.c_str());
+        result = new_result();
+        result->value = {.type = BOOLEAN_T, .val_bool = error == 0};
+        break;
+    }
+    }
+    context->completion_callback(command->id, result);
+    delete command;
+}
+
+static void drain_commands(NodeContext *context) {
+    while (Command *command = context->commands.pop()) {
+        run_command(context, command);
+    }
+}
+
+// Owns the event loop while the thread runs. The isolate is only locked to
+// run callbacks and commands, waiting for I/O happens outside of the lock so
+// that other threads can still use the isolate (e.g. lazy handles).
+static void js_thread_main(NodeContext *context) {
+    while (!context->thread_stopping.load(std::memory_order_acquire)) {
+        int timeout;
+        {
+            Locker locker(context->isolate);
+            Isolate::Scope isolate_scope(context->isolate);
+            HandleScope handle_scope(context->isolate);
+            v8::Local<Context> local_ctx =
+                context->global_ctx.Get(context->isolate);
+            v8::Context::Scope context_scope(local_ctx);
+            uv_run(context->loop, UV_RUN_NOWAIT);
+            deliver_futures(context);
+            context->handles.collect();
+        }
+        // Commands posted from here on also make the backend readable
+        // through the wakeup handle, so the wait can not miss them.
+        drain_commands(context);
+        {
+            Locker locker(context->isolate);
+            timeout = uv_backend_timeout(context->loop);
+        }
+        if (context->thread_stopping.load(std::memory_order_acquire)) {
+            break;
+        }
+#ifdef _WIN32
+        // No pollable fd, wait for a completion packet of the loop (I/O or
+        // the wakeup handle) and hand it back to libuv for the next turn.
+        DWORD bytes;
+        ULONG_PTR key;
+        OVERLAPPED *overlapped = nullptr;
+        GetQueuedCompletionStatus(context->loop->iocp, &bytes, &key,
+                                  &overlapped,
+                                  timeout < 0 ? INFINITE : timeout);
+        if (overlapped != nullptr) {
+            PostQueuedCompletionStatus(context->loop->iocp, bytes, key,
+                                       overlapped);
+        }
+#else
+        struct pollfd fd = {uv_backend_fd(context->loop), POLLIN, 0};
+        poll(&fd, 1, timeout);
+#endif
+    }
+}
+
+int NodeContext_Start_Thread(NodeContext *context) {
+    if (context->js_thread.joinable()) {
+        return 0;
+    }
+    if (context->completion_callback == nullptr) {
+        std::cerr << "PYTHONODEJS: No completion callback set." << std::endl;
+        return 1;
+    }
+    {
+        Locker locker(context->isolate);
+        if (uv_async_init(context->loop, &context->wakeup, nullptr) != 0) {
+            return 1;
+        }
+    }
+    context->nonblocking = true;
+    context->thread_stopping.store(false, std::memory_order_release);
+    context->js_thread = std::thread(js_thread_main, context);
+    context->thread_running.store(true);
+    return 0;
+}
+
+void NodeContext_Stop_Thread(NodeContext *context) {
+    if (!context->js_thread.joinable()) {
+        return;
+    }
+    context->thread_running.store(false);
+    while (context->posting.load() != 0) {
+        std::this_thread::yield();
+    }
+    context->thread_stopping.store(true, std::memory_order_release);
+    uv_async_send(&context->wakeup);
+    context->js_thread.join();
+
+    // Commands posted during shutdown still complete, on this thread.
+    drain_commands(context);
+    Locker locker(context->isolate);
+    uv_close(reinterpret_cast<uv_handle_t *>(&context->wakeup), nullptr);
+    uv_run(context->loop, UV_RUN_NOWAIT);
+    context->nonblocking = false;
+}
+
+bool NodeContext_On_Thread(NodeContext *context) {
+    return context->js_thread.get_id() == std::this_thread::get_id();
+}
+
+// Result of a command that could not run, shaped like a JS Error.
+static NodeResult *error_result(const char *message) {
+    NodeResult *result = new_result();
+    NodeArena &arena = *result->arena;
+    auto text = [&](const char *chars) -> NodeValue {
+        size_t length = strlen(chars);
+        char *copy = static_cast<char *>(arena.alloc(length + 1, 1));
+        memcpy(copy, chars, length + 1);
+        return {.type = STRING,
+                .length = static_cast<uint32_t>(length),
+                .val_string = copy};
+    };
+    NodeValue *fields = arena.values(3);
+    fields[0] = text(message);
+    fields[1] = text("Error");
+    fields[2] = text("");
+    result->value = {.type = ERROR_T, .length = 3, .val_children = fields};
+    return result;
+}
+
+// Commands posted while no JS thread runs complete at once with an error,
+// the wakeup handle only exists between Start_Thread and Stop_Thread.
+static void post(NodeContext *context, Command *command) {
+    context->posting.fetch_add(1);
+    if (!context->thread_running.load()) {
+        context->posting.fetch_sub(1);
+        if (context->completion_callback != nullptr) {
+            context->completion_callback(
+                command->id, error_result("The JS thread is not running."));
+        }
+        delete command;
+        return;
+    }
+    context->commands.push(command);
+    uv_async_send(&context->wakeup);
+    context->posting.fetch_sub(1);
+}
+
+void NodeContext_Post_Script(NodeContext *context, int64_t id,
+                             const char *code, int transfer) {
+    Command *command = new Command();
+    command->kind = Command::SCRIPT;
+    command->id = id;
+    command->code = code;
+    command->transfer = transfer;
+    post(context, command);
+}
+
+void NodeContext_Post_Call(NodeContext *context, int64_t id,
+                           NodeValue function, NodeValue *args,
+                           size_t args_length, bool construct,
+                           int transfer) {
+    Command *command = new Command();
+    command->kind = construct ? Command::CONSTRUCT : Command::CALL;
+    command->id = id;
+    command->function = function;
+    command->args = args;
+    command->args_length = args_length;
+    command->transfer = transfer;
+    post(context, command);
+}
+
+void NodeContext_Post_Map(NodeContext *context, int64_t id, NodeValue function,
+                          NodeValue *rows, size_t num_rows) {
+    Command *command = new Command();
+    command->kind = Command::MAP;
+    command->id = id;
+    command->function = function;
+    command->args = rows;
+    command->args_length = num_rows;
+    post(context, command);
+}
+
+void NodeContext_Post_Define(NodeContext *context, int64_t id,
+                             const char **keys, NodeValue *values,
+                             int length) {
+    Command *command = new Command();
+    command->kind = Command::DEFINE;
+    command->id = id;
+    command->keys = keys;
+    command->args = values;
+    command->args_length = length;
+    post(context, command);
+}
+
+void NodeContext_Post_Profile_Start(NodeContext *context, int64_t id,
+                                    int sampling_interval_us) {
+    Command *command = new Command();
+    command->kind = Command::PROFILE_START;
+    command->id = id;
+    command->sampling_interval = sampling_interval_us;
+    post(context, command);
+}
+
+void NodeContext_Post_Profile_Stop(NodeContext *context, int64_t id,
+                                   const char *path,
+                                   const char *collapsed_path) {
+    Command *command = new Command();
+    command->kind = Command::PROFILE_STOP;
+    command->id = id;
+    command->code = path;
+    command->collapsed_path = collapsed_path ? collapsed_path : "";
+    post(context, command);
 }
 
 void NodeContext_Stop(NodeContext *context) { node::Stop(context->env); }
 
 void NodeContext_Dispose(NodeContext *context) {
-    context->global_ctx.Reset();
-    context->runInThisContext.Reset();
+    NodeContext_Stop_Thread(context);
+    if (context->setup) {
+        {
+            Locker locker(context->isolate);
+            FutureTable &futures = context->futures;
+            if (futures.check_open) {
+                uv_close(reinterpret_cast<uv_handle_t *>(&futures.check),
+                         nullptr);
+                uv_run(context->loop, UV_RUN_NOWAIT);
+                futures.check_open = false;
+            }
+            context->global_ctx.Reset();
+            context->runInThisContext.Reset();
+            context->keys.clear();
+            // Buffer stores stay valid for Python views on them, until the
+            // context is destroyed.
+            for (HandleTable::Slot &slot : context->handles.slots) {
+                slot.value.Reset();
+                slot.recv.Reset();
+            }
+            futures.bridge.Reset();
+            futures.resolvers.clear();
+            if (context->heap_sampling) {
+                context->isolate->GetHeapProfiler()->StopSamplingHeapProfiler();
+                context->heap_sampling = false;
+            }
+            if (context->profiler != nullptr) {
+                // Also drops a profile still being recorded.
+                context->profiler->Dispose();
+                context->profiler = nullptr;
+                context->profiling = false;
+            }
+            Node_Release_Result(futures.settled);
+            futures.settled = nullptr;
+            futures.settled_values.clear();
+        }
+        // Frees the environment, loop and isolate of this context only.
+        context->setup.reset();
+    }
+}
+
+void Node_Shutdown() {
+    std::lock_guard<std::mutex> lock(process_mutex);
+    if (!process_platform) {
+        return;
+    }
     V8::Dispose();
     V8::DisposePlatform();
+    process_platform.reset();
+    uv_run(&process_probe->loop, UV_RUN_DEFAULT);
+    uv_loop_close(&process_probe->loop);
+    delete process_probe;
+    process_probe = nullptr;
     node::TearDownOncePerProcess();
 }
 
-void Node_Dispose_Value(NodeValue value) {
-    if (value.function != nullptr) {
-        value.function->function.Reset();
-        delete value.function;
+void Node_Release_Result(NodeResult *result) {
+    if (result != nullptr) {
+        // The result itself lives in its arena.
+        NodeArena::live_results.fetch_sub(1, std::memory_order_relaxed);
+        delete result->arena;
     }
-    if (value.val_big != nullptr) {
-        free(value.val_big);
-        value.val_big = nullptr;
+}
+
+static bool is_buffer(const NodeValue &value) {
+    return value.type == TYPED_ARRAY || value.type == ARRAY_BUFFER ||
+           value.type == SHARED_ARRAY_BUFFER;
+}
+
+void NodeContext_Release_Handles(NodeContext *context, const uint64_t *refs,
+                                 int count) {
+    std::lock_guard<std::mutex> lock(context->handles.pending_mutex);
+    context->handles.pending.insert(context->handles.pending.end(), refs,
+                                    refs + count);
+}
+
+void NodeContext_Release_Futures(NodeContext *context, const int64_t *ids,
+                                 int count) {
+    FutureTable &futures = context->futures;
+    std::lock_guard<std::mutex> lock(futures.released_mutex);
+    futures.released.insert(futures.released.end(), ids, ids + count);
+}
+
+void NodeContext_Handle_Stats(NodeContext *context, NodeHandleStats *stats) {
+    Locker locker(context->isolate);
+    HandleTable &handles = context->handles;
+    stats->live = handles.slots.size() - handles.free_slots.size();
+    stats->slots = handles.slots.size();
+    stats->created = handles.created;
+    stats->released = handles.released;
+    stats->stale = handles.stale;
+    std::lock_guard<std::mutex> lock(handles.pending_mutex);
+    stats->pending = handles.pending.size();
+}
+
+int NodeContext_Drain_Released(NodeContext *context, void **buffers,
+                               int capacity) {
+    std::lock_guard<std::mutex> lock(context->released_mutex);
+    int count = static_cast<int>(
+        std::min(context->released.size(), static_cast<size_t>(capacity)));
+    std::copy(context->released.end() - count, context->released.end(),
+              buffers);
+    context->released.resize(context->released.size() - count);
+    return count;
+}
+
+void NodeContext_Timing_Enable(NodeContext *context, bool enabled) {
+    context->timing_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+void NodeContext_Timing_Reset(NodeContext *context) {
+    std::lock_guard<std::mutex> lock(context->timing.mutex);
+    for (auto &sites : context->timing.sites) {
+        sites.clear();
+    }
+}
+
+void NodeContext_Timing_Record(NodeContext *context, int kind,
+                               const char *site, int phase, uint64_t ns) {
+    if (kind < 0 || kind >= TIMING_KINDS || phase < 0 ||
+        phase >= TIMING_PHASES) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(context->timing.mutex);
+    context->timing.site(kind, site ? site : "")[phase].add(ns);
+}
+
+int NodeContext_Timing_Read(NodeContext *context,
+                            NodeTimingHistogram *histograms, int capacity) {
+    std::lock_guard<std::mutex> lock(context->timing.mutex);
+    int count = 0;
+    for (int kind = 0; kind < TIMING_KINDS; kind++) {
+        for (const auto &[name, site] : context->timing.sites[kind]) {
+            for (int phase = 0; phase < TIMING_PHASES; phase++) {
+                const TimingTable::Histogram &histogram = site[phase];
+                if (histogram.count == 0) {
+                    continue;
+                }
+                if (count < capacity) {
+                    NodeTimingHistogram &out = histograms[count];
+                    snprintf(out.site, sizeof(out.site), "%s", name.c_str());
+                    out.kind = kind;
+                    out.phase = phase;
+                    out.count = histogram.count;
+                    out.total_ns = histogram.total_ns;
+                    out.max_ns = histogram.max_ns;
+                    std::copy(std::begin(histogram.buckets),
+                              std::end(histogram.buckets), out.buckets);
+                }
+                count++;
+            }
+        }
+    }
+    return count;
+}
+
+void NodeContext_Memory_Stats(NodeContext *context, NodeMemoryStats *stats) {
+    *stats = {};
+    stats->live_results =
+        NodeArena::live_results.load(std::memory_order_relaxed);
+    stats->arena_bytes = NodeArena::live_bytes.load(std::memory_order_relaxed);
+    if (!context->setup) {
+        return;
     }
-    if (value.val_string != nullptr) {
-        free(value.val_string);
-        value.val_string = nullptr;
+    Locker locker(context->isolate);
+    v8::HeapStatistics heap;
+    context->isolate->GetHeapStatistics(&heap);
+    stats->total_heap_size = heap.total_heap_size();
+    stats->total_heap_size_executable = heap.total_heap_size_executable();
+    stats->total_physical_size = heap.total_physical_size();
+    stats->total_available_size = heap.total_available_size();
+    stats->used_heap_size = heap.used_heap_size();
+    stats->heap_size_limit = heap.heap_size_limit();
+    stats->malloced_memory = heap.malloced_memory();
+    stats->peak_malloced_memory = heap.peak_malloced_memory();
+    stats->external_memory = heap.external_memory();
+    stats->native_contexts = heap.number_of_native_contexts();
+    stats->detached_contexts = heap.number_of_detached_contexts();
+
+    HandleTable &handles = context->handles;
+    stats->live_handles = handles.slots.size() - handles.free_slots.size();
+    FutureTable &futures = context->futures;
+    {
+        std::lock_guard<std::mutex> lock(futures.released_mutex);
+        stats->pending_futures = futures.next_id - futures.free_ids.size() -
+                                 futures.released.size();
     }
-    if (value.val_tarray != nullptr) {
-        free(value.val_tarray);
-        value.val_tarray = nullptr;
+    for (const v8::Global<v8::Promise::Resolver> &resolver :
+         futures.resolvers) {
+        stats->pending_resolvers += !resolver.IsEmpty();
     }
-    if (value.error_message != nullptr) {
-        free(value.error_message);
-        value.error_message = nullptr;
+}
+
+int NodeContext_Heap_Space_Stats(NodeContext *context,
+                                 NodeHeapSpaceStats *spaces, int capacity) {
+    if (!context->setup) {
+        return 0;
     }
-    if (value.error_name != nullptr) {
-        free(value.error_name);
-        value.error_name = nullptr;
+    Locker locker(context->isolate);
+    Isolate *isolate = context->isolate;
+    int count = static_cast<int>(isolate->NumberOfHeapSpaces());
+    for (int i = 0; i < count && i < capacity; i++) {
+        v8::HeapSpaceStatistics space;
+        isolate->GetHeapSpaceStatistics(&space, i);
+        NodeHeapSpaceStats &out = spaces[i];
+        snprintf(out.name, sizeof(out.name), "%s", space.space_name());
+        out.space_size = space.space_size();
+        out.space_used_size = space.space_used_size();
+        out.space_available_size = space.space_available_size();
+        out.physical_space_size = space.physical_space_size();
     }
-    if (value.error_stack != nullptr) {
-        free(value.error_stack);
-        value.error_stack = nullptr;
+    return count;
+}
+
+void *NodeContext_Buffer_Data(NodeContext *context, NodeValue value,
+                              size_t *byte_length) {
+    Locker locker(context->isolate);
+    HandleTable::Slot *buffer =
+        is_buffer(value) ? handle_slot(context, value) : nullptr;
+    if (buffer == nullptr) {
+        *byte_length = 0;
+        return nullptr;
     }
-    if (value.parent != nullptr) {
-        //((Val*) value.parent)->value.Reset();
-        // delete ((Val*) value.parent);
+    *byte_length = buffer->byte_length;
+    return buffer->data;
+}
+
+const char *NodeContext_Handle_Name(NodeContext *context, NodeValue value) {
+    Locker locker(context->isolate);
+    if (value.type != FUNCTION && value.type != SYMBOL) {
+        return nullptr;
     }
-    if (value.val_array != nullptr) {
-        free(value.val_array);
-        value.val_array = nullptr;
+    HandleTable::Slot *handle = handle_slot(context, value);
+    return handle != nullptr ? handle->name.c_str() : nullptr;
+}
+
+// Writes what V8 serializes (profiles, heap snapshots) straight to a file.
+class FileStream : public v8::OutputStream {
+  public:
+    explicit FileStream(const char *path)
+        : file(path, std::ios::binary | std::ios::trunc) {}
+
+    bool good() const { return file.good(); }
+
+    void EndOfStream() override { file.flush(); }
+    int GetChunkSize() override { return 64 * 1024; }
+
+    WriteResult WriteAsciiChunk(char *data, int size) override {
+        return file.write(data, size) ? kContinue : kAbort;
     }
-    if (value.object_keys != nullptr) {
-        for (uint32_t i = 0; i < value.object_len; ++i) {
-            if (value.object_keys[i] != nullptr) {
-                free(value.object_keys[i]);
-            }
+
+  private:
+    std::ofstream file;
+};
+
+// One "caller;callee;... self_samples" line per node with samples, the
+// format read by flamegraph.pl, speedscope and inferno.
+static void write_collapsed(std::ostream &out, const v8::CpuProfileNode *node,
+                            std::string &stack) {
+    size_t length = stack.size();
+    if (node->GetParent() != nullptr) { // the root is not a frame
+        if (!stack.empty()) {
+            stack += ';';
         }
-        free(value.object_keys);
-        value.object_keys = nullptr;
+        const char *name = node->GetFunctionNameStr();
+        stack += *name ? name : "(anonymous)";
+        const char *script = node->GetScriptResourceNameStr();
+        if (*script) {
+            stack += " (";
+            stack += script;
+            stack += ':';
+            stack += std::to_string(node->GetLineNumber());
+            stack += ')';
+        }
+        // Frame separators inside names would split the frame.
+        std::replace(stack.begin() + length + (length != 0), stack.end(), ';',
+                     ',');
+    }
+    if (node->GetHitCount() > 0 && !stack.empty()) {
+        out << stack << ' ' << node->GetHitCount() << '\n';
     }
-    if (value.object_values != nullptr) {
-        free(value.object_values);
-        value.object_values = nullptr;
+    for (int i = 0; i < node->GetChildrenCount(); i++) {
+        write_collapsed(out, node->GetChild(i), stack);
+    }
+    stack.resize(length);
+}
+
+int NodeContext_Profile_Start(NodeContext *context, int sampling_interval_us) {
+    if (!context->setup) {
+        return 1;
+    }
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    if (context->profiling) {
+        std::cerr << "PYTHONODEJS: A CPU profile is already being recorded."
+                  << std::endl;
+        return 1;
+    }
+    if (context->profiler == nullptr) {
+        context->profiler = v8::CpuProfiler::New(context->isolate);
+    }
+    if (sampling_interval_us > 0) {
+        context->profiler->SetSamplingInterval(sampling_interval_us);
+    }
+    // Samples are kept for the timeline of the .cpuprofile.
+    v8::CpuProfilingResult started = context->profiler->Start(
+        v8::CpuProfilingOptions(v8::kLeafNodeLineNumbers,
+                                v8::CpuProfilingOptions::kNoSampleLimit,
+                                sampling_interval_us));
+    if (started.status != v8::CpuProfilingStatus::kStarted) {
+        std::cerr << "PYTHONODEJS: Failed to start the CPU profiler."
+                  << std::endl;
+        return 1;
     }
-    if (value.map_keys != nullptr) {
-        free(value.map_keys);
-        value.map_keys = nullptr;
+    context->profile_id = started.id;
+    context->profiling = true;
+    return 0;
+}
+
+int NodeContext_Profile_Stop(NodeContext *context, const char *path,
+                             const char *collapsed_path) {
+    if (!context->setup) {
+        return 1;
+    }
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    if (!context->profiling) {
+        std::cerr << "PYTHONODEJS: No CPU profile is being recorded."
+                  << std::endl;
+        return 1;
+    }
+    context->profiling = false;
+    v8::CpuProfile *profile = context->profiler->Stop(context->profile_id);
+    if (profile == nullptr) {
+        return 1;
+    }
+    int error = 0;
+    if (path != nullptr) {
+        FileStream stream(path);
+        profile->Serialize(&stream);
+        error |= !stream.good();
+    }
+    if (collapsed_path != nullptr) {
+        std::ofstream file(collapsed_path, std::ios::trunc);
+        std::string stack;
+        write_collapsed(file, profile->GetTopDownRoot(), stack);
+        error |= !file.good();
+    }
+    profile->Delete();
+    if (error) {
+        std::cerr << "PYTHONODEJS: Failed to write the CPU profile."
+                  << std::endl;
+    }
+    return error;
+}
+
+// Root of the JS values held by the bridge in heap snapshots. Without it,
+// what Python keeps alive only shows up as anonymous global handles.
+class BridgeRoot : public v8::EmbedderGraph::Node {
+  public:
+    const char *Name() override { return "pythonodejs handles"; }
+    size_t SizeInBytes() override { return 0; }
+    bool IsRootNode() override { return true; }
+};
+
+static void build_embedder_graph(Isolate *isolate, v8::EmbedderGraph *graph,
+                                 void *data) {
+    NodeContext *context = static_cast<NodeContext *>(data);
+    HandleScope handle_scope(isolate);
+    v8::EmbedderGraph::Node *root =
+        graph->AddNode(std::make_unique<BridgeRoot>());
+    auto add_edge = [&](const auto &global, const char *name) {
+        if (!global.IsEmpty()) {
+            v8::Local<Value> value = global.Get(isolate);
+            graph->AddEdge(root, graph->V8Node(value), name);
+        }
+    };
+    // Edges are named after the function or symbol, and numbered otherwise.
+    for (const HandleTable::Slot &slot : context->handles.slots) {
+        if (slot.live) {
+            add_edge(slot.value,
+                     slot.name.empty() ? nullptr : slot.name.c_str());
+            add_edge(slot.recv, "this");
+        }
+    }
+    add_edge(context->futures.bridge, "future bridge");
+    for (const auto &resolver : context->futures.resolvers) {
+        add_edge(resolver, "Python future");
+    }
+}
+
+int NodeContext_Heap_Snapshot(NodeContext *context, const char *path) {
+    if (!context->setup) {
+        return 1;
+    }
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    // Handles Python already let go of are not retainers.
+    context->handles.collect();
+    v8::HeapProfiler *profiler = context->isolate->GetHeapProfiler();
+    if (!context->embedder_graph_added) {
+        profiler->AddBuildEmbedderGraphCallback(build_embedder_graph, context);
+        context->embedder_graph_added = true;
+    }
+    const v8::HeapSnapshot *snapshot = profiler->TakeHeapSnapshot();
+    if (snapshot == nullptr) {
+        return 1;
+    }
+    FileStream stream(path);
+    snapshot->Serialize(&stream);
+    const_cast<v8::HeapSnapshot *>(snapshot)->Delete();
+    if (!stream.good()) {
+        std::cerr << "PYTHONODEJS: Failed to write the heap snapshot."
+                  << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int NodeContext_Heap_Sampling_Start(NodeContext *context,
+                                    uint64_t sampling_interval,
+                                    int stack_depth) {
+    if (!context->setup) {
+        return 1;
+    }
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    if (context->heap_sampling) {
+        std::cerr << "PYTHONODEJS: The heap is already being sampled."
+                  << std::endl;
+        return 1;
+    }
+    v8::HeapProfiler *profiler = context->isolate->GetHeapProfiler();
+    if (!profiler->StartSamplingHeapProfiler(
+            sampling_interval > 0 ? sampling_interval : 512 * 1024,
+            stack_depth > 0 ? stack_depth : 16)) {
+        std::cerr << "PYTHONODEJS: Failed to start the sampling heap profiler."
+                  << std::endl;
+        return 1;
+    }
+    context->heap_sampling = true;
+    return 0;
+}
+
+static void set_field(Isolate *isolate, v8::Local<Context> local_ctx,
+                      v8::Local<v8::Object> object, const char *key,
+                      v8::Local<Value> value) {
+    v8::Local<v8::String> name =
+        v8::String::NewFromUtf8(isolate, key).ToLocalChecked();
+    object->Set(local_ctx, name, value).Check();
+}
+
+// Node of the call tree of a .heapprofile, as Chrome DevTools writes it.
+static v8::Local<v8::Object>
+heap_profile_node(Isolate *isolate, v8::Local<Context> local_ctx,
+                  const v8::AllocationProfile::Node *node) {
+    auto set = [&](v8::Local<v8::Object> object, const char *key,
+                   v8::Local<Value> value) {
+        set_field(isolate, local_ctx, object, key, value);
+    };
+    v8::Local<v8::Object> frame = v8::Object::New(isolate);
+    set(frame, "functionName", node->name);
+    set(frame, "scriptId",
+        v8::String::NewFromUtf8(isolate,
+                                std::to_string(node->script_id).c_str())
+            .ToLocalChecked());
+    set(frame, "url", node->script_name);
+    // Zero based in DevTools, one based in V8.
+    set(frame, "lineNumber", v8::Integer::New(isolate, node->line_number - 1));
+    set(frame, "columnNumber",
+        v8::Integer::New(isolate, node->column_number - 1));
+
+    double self_size = 0;
+    for (const v8::AllocationProfile::Allocation &allocation :
+         node->allocations) {
+        self_size += static_cast<double>(allocation.size) * allocation.count;
+    }
+    v8::Local<v8::Array> children =
+        v8::Array::New(isolate, static_cast<int>(node->children.size()));
+    for (size_t i = 0; i < node->children.size(); i++) {
+        children
+            ->Set(local_ctx, static_cast<uint32_t>(i),
+                  heap_profile_node(isolate, local_ctx, node->children[i]))
+            .Check();
+    }
+
+    v8::Local<v8::Object> out = v8::Object::New(isolate);
+    set(out, "callFrame", frame);
+    set(out, "selfSize", v8::Number::New(isolate, self_size));
+    set(out, "id", v8::Integer::NewFromUnsigned(isolate, node->node_id));
+    set(out, "children", children);
+    return out;
+}
+
+int NodeContext_Heap_Sampling_Stop(NodeContext *context, const char *path) {
+    if (!context->setup) {
+        return 1;
+    }
+    Locker locker(context->isolate);
+    Isolate::Scope isolate_scope(context->isolate);
+    HandleScope handle_scope(context->isolate);
+    if (!context->heap_sampling) {
+        std::cerr << "PYTHONODEJS: The heap is not being sampled."
+                  << std::endl;
+        return 1;
+    }
+    Isolate *isolate = context->isolate;
+    v8::Local<Context> local_ctx = context->global_ctx.Get(isolate);
+    v8::Context::Scope context_scope(local_ctx);
+    v8::HeapProfiler *profiler = isolate->GetHeapProfiler();
+    std::unique_ptr<v8::AllocationProfile> profile(
+        profiler->GetAllocationProfile());
+    profiler->StopSamplingHeapProfiler();
+    context->heap_sampling = false;
+    if (!profile) {
+        return 1;
+    }
+
+    const std::vector<v8::AllocationProfile::Sample> &samples =
+        profile->GetSamples();
+    v8::Local<v8::Array> sample_list =
+        v8::Array::New(isolate, static_cast<int>(samples.size()));
+    for (size_t i = 0; i < samples.size(); i++) {
+        const v8::AllocationProfile::Sample &sample = samples[i];
+        double size = static_cast<double>(sample.size) * sample.count;
+        v8::Local<v8::Object> entry = v8::Object::New(isolate);
+        set_field(isolate, local_ctx, entry, "size",
+                  v8::Number::New(isolate, size));
+        set_field(isolate, local_ctx, entry, "nodeId",
+                  v8::Integer::NewFromUnsigned(isolate, sample.node_id));
+        set_field(isolate, local_ctx, entry, "ordinal",
+                  v8::Number::New(isolate,
+                                  static_cast<double>(sample.sample_id)));
+        sample_list->Set(local_ctx, static_cast<uint32_t>(i), entry).Check();
+    }
+    v8::Local<v8::Object> out = v8::Object::New(isolate);
+    set_field(isolate, local_ctx, out, "head",
+              heap_profile_node(isolate, local_ctx, profile->GetRootNode()));
+    set_field(isolate, local_ctx, out, "samples", sample_list);
+
+    v8::Local<v8::String> json;
+    if (!v8::JSON::Stringify(local_ctx, out).ToLocal(&json)) {
+        return 1;
+    }
+    v8::String::Utf8Value text(isolate, json);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file.write(*text, text.length())) {
+        std::cerr << "PYTHONODEJS: Failed to write the heap profile."
+                  << std::endl;
+        return 1;
     }
+    return 0;
 }
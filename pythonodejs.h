@@ -19,8 +19,7 @@ typedef enum { false, true } bool;
 #endif
 
 typedef struct NodeContext NodeContext;
-typedef struct Func Func;
-typedef struct Val Val;
+typedef struct NodeArena NodeArena;
 
 typedef enum NodeValueType : int { // explicitly 4 bytes
     UNDEFINED,
@@ -46,9 +45,61 @@ typedef enum NodeValueType : int { // explicitly 4 bytes
     MODULE_NAMESPACE, // UNUSED (Object)
     ERROR_T,
     PROMISE,
-    SET
+    SET,
+    LAZY_OBJECT, // Handle only, properties are fetched on demand
+    LAZY_ARRAY,  // Handle only, elements are fetched on demand
+    SHARED_ARRAY_BUFFER,
+    JSON_T,          // JSON text, see NodeTransfer
+    SERIALIZED,      // V8 structured clone bytes, see NodeTransfer
+    STRING_ONE_BYTE, // Latin-1 characters
+    STRING_TWO_BYTE  // UTF-16 code units
 } NodeValueType;
 
+// How a result crosses to the caller. TRANSFER_TREE converts it to a
+// NodeValue tree, TRANSFER_JSON to a single JSON_T value made with
+// JSON.stringify and TRANSFER_CLONE to a single SERIALIZED value made with
+// v8::ValueSerializer. Both are also accepted as arguments and parsed or
+// deserialized in JS, so large plain data crosses as one buffer.
+typedef enum NodeTransfer : int {
+    TRANSFER_TREE,
+    TRANSFER_JSON,
+    TRANSFER_CLONE
+} NodeTransfer;
+
+// Bridge operations and their phases timed by NodeContext_Timing_Enable.
+typedef enum NodeTimingKind : int {
+    TIMING_SCRIPT,    // Run_Script, site is empty
+    TIMING_CALL,      // Call_Function, site is the function name
+    TIMING_CONSTRUCT, // Construct_Function
+    TIMING_CALLBACK,  // JS calling a Python function
+    TIMING_SETTLE,    // JS promise settling a Python awaitable
+    TIMING_RESOLVE,   // Python future settling a JS promise
+    TIMING_KINDS
+} NodeTimingKind;
+
+typedef enum NodeTimingPhase : int {
+    PHASE_ARGS,   // to_v8_value: call arguments, callback return value
+    PHASE_RUN,    // JS, or the Python callback, running
+    PHASE_LOOP,   // event loop run after the call
+    PHASE_RESULT, // to_node_value: call result, callback arguments
+    PHASE_PYTHON, // conversion on the Python side, recorded by the wrapper
+    TIMING_PHASES
+} NodeTimingPhase;
+
+#define TIMING_BUCKETS 40
+
+// Durations of one phase at one site. Bucket i counts durations in
+// [2^i, 2^(i+1)) nanoseconds, the last one everything longer.
+typedef struct NodeTimingHistogram {
+    char site[64];
+    int32_t kind;
+    int32_t phase;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TIMING_BUCKETS];
+} NodeTimingHistogram;
+
 typedef enum TypedArrayType : int { // explicitly 4 bytes
     INT8_T,
     UINT8_T,
@@ -62,72 +113,322 @@ typedef enum TypedArrayType : int { // explicitly 4 bytes
     FLOAT64_T
 } TypedArrayType;
 
+// Compact tagged value (16 bytes). Everything that does not fit in the
+// payload is stored out of line:
+//   STRING, REGEXP           val_string, length = byte length
+//                            (REGEXP: subtype = v8::RegExp::Flags. Object
+//                            keys: subtype = id of the key interned by the
+//                            context, 0 if not, val_string is then owned by
+//                            the context. Keys can be passed back by id
+//                            alone, val_string is ignored then)
+//   STRING_ONE_BYTE,         val_ptr, length = number of characters (strings
+//   STRING_TWO_BYTE          from JS come in V8's own representation). Going
+//                            to JS, subtype = 1 lends the characters to V8
+//                            as an external string until they are returned
+//                            by NodeContext_Drain_Released
+//   BIGINT                   val_int when length = 0, otherwise val_ptr =
+//                            uint64_t words[length], least significant
+//                            first, subtype = 1 if negative
+//   ARRAY, SET               val_children[length]
+//   OBJECT, MAP              val_children[2 * length], key/value pairs
+//   ERROR_T                  val_children[3], message/name/stack
+//   PROXY                    val_children[2], target/handler
+//   TYPED_ARRAY              val_ptr, length = byte length,
+//                            subtype = TypedArrayType
+//   ARRAY_BUFFER,            val_ptr, length = byte length
+//   SHARED_ARRAY_BUFFER      (coming from JS, these are val_ref instead: a
+//                            handle on the V8 backing store, not a copy.
+//                            Going to JS, val_ptr is lent to V8 until it is
+//                            returned by NodeContext_Drain_Released)
+//   FUNCTION, SYMBOL,        val_ref (LAZY_ARRAY: length = array length)
+//   LAZY_OBJECT
+//   JSON_T                   val_string, length = byte length
+//   SERIALIZED               val_ptr, length = byte length
+//   PROMISE                  val_int = future id (from JS, ids are reused
+//                            once their settlement was delivered and they
+//                            were released with NodeContext_Release_Futures.
+//                            To JS, the id is picked by the caller, a small
+//                            index it may reuse after NodeContext_FutureUpdate)
+//   EXTERNAL                 val_ptr
+//   DATE_T, NUMBER           val_num
 typedef struct NodeValue {
-    NodeValueType type;
-    void *self_ptr;
-    bool val_bool;
-    double val_num;
-    char *val_string; // Used for string, symbol description, function name, and
-                      // regex pattern
-    struct Func *function;
-    struct NodeValue *val_array; // Reuse for set
-    void *val_tarray;            // Reuse for arraybuffer and dataview
-    TypedArrayType val_tarray_type;
-    int val_array_len; // Reuse for set, typedarray and arraybuffer
-    char *val_big;
-    char **object_keys;
-    struct NodeValue *map_keys;
-    struct NodeValue *object_values; // Reuse for map
-    int object_len;
-    double val_date_unix;
-    int val_regex_flags;
-    void *val_external_ptr; // Reuse for Symbol
-
-    int64_t future_id;
-
-    char *error_message;
-    char *error_name;
-    char *error_stack;
-
-    struct NodeValue *proxy_target;
-    struct NodeValue *proxy_handler;
-    void *parent;
+    uint16_t type;    // NodeValueType
+    uint16_t subtype; // TypedArrayType, RegExp flags or key id
+    uint32_t length;
+    union {
+        bool val_bool;
+        double val_num;
+        int64_t val_int;
+        char *val_string;
+        struct NodeValue *val_children;
+        void *val_ptr;
+        uint64_t val_ref; // handle in the table of the context
+    };
 } NodeValue;
 
+// A converted value together with the arena holding its out-of-line storage.
+// The result itself lives in the arena, Node_Release_Result frees both.
+typedef struct NodeResult {
+    NodeValue value;
+    NodeArena *arena;
+} NodeResult;
+
 typedef void *(*Callback)(const char *function_name, const NodeValue *values,
                           int length);
-typedef void *(*FutureCallback)(int64_t id, NodeValue result, bool reject);
+// Promises settled since the last call, as an ARRAY of PROMISE headers
+// (subtype = 1 if rejected) each followed by the value. To be released with
+// Node_Release_Result, the ids with NodeContext_Release_Futures once the
+// promises they stand for are no longer looked up.
+typedef void (*FutureCallback)(NodeResult *settled);
+// Result of a posted command, to be released with Node_Release_Result.
+typedef void (*CompletionCallback)(int64_t id, NodeResult *result);
+
+// Counters of the process-wide platform. V8 worker tasks are counted as they
+// are posted and run. The libuv threadpool is probed with a no-op work item,
+// its wait is how long work currently queues behind busy threads.
+typedef struct NodePlatformStats {
+    int32_t platform_workers;
+    int32_t uv_threadpool_size;
+    uint64_t tasks_queued;
+    uint64_t tasks_running;
+    uint64_t tasks_completed;
+    uint64_t jobs_running;
+    uint64_t uv_probe_wait_ns;
+} NodePlatformStats;
+
+// Sets the number of V8 platform workers (default 4), the size of the libuv
+// threadpool (0 keeps UV_THREADPOOL_SIZE or libuv's default) and the CPUs
+// both are pinned to (Linux only, none to leave them unpinned). Must be called
+// before the first NodeContext_Setup, returns 1 once the platform exists.
+EXPORT int Node_Configure(int platform_workers, int uv_threadpool_size,
+                          const int *cpus, int num_cpus);
+// Fills `stats`, zeroed before the first NodeContext_Setup.
+EXPORT void Node_Platform_Stats(NodePlatformStats *stats);
 
 EXPORT NodeContext *NodeContext_Create();
 EXPORT int NodeContext_Setup(NodeContext *context, int argc, char **argv);
+// `thread_pool_size` is unused, worker threads are set with Node_Configure.
 EXPORT int NodeContext_Init(NodeContext *context, char **imports,
                             int num_imports, int thread_pool_size);
 
+// Makes NodeContext_Init start from a snapshot built by
+// NodeContext_Build_Snapshot (NULL or "" for a regular start). `imports` are
+// ignored in that case, the snapshot already has its modules loaded.
+EXPORT void NodeContext_SetSnapshot(NodeContext *context, const char *path);
+// Writes a startup snapshot to `path` after requiring `modules` and running
+// the `warmup` script. Called instead of NodeContext_Init, the context can not
+// run code afterwards.
+EXPORT int NodeContext_Build_Snapshot(NodeContext *context, const char *path,
+                                      char **modules, int num_modules,
+                                      const char *warmup);
+
 EXPORT void NodeContext_SetCallback(NodeContext *context, Callback cb);
 EXPORT void NodeContext_SetFutureCallback(NodeContext *context,
                                           FutureCallback cb);
+EXPORT void NodeContext_SetLazy(NodeContext *context, bool lazy);
+// Enables the on-disk code cache of Run_Script in `dir` (NULL or "" disables
+// it), least recently used entries are evicted past `max_bytes`. Entries are
+// kept in pythonodejs-v8-<version> subdirectories, those of other V8 versions
+// are removed here. Anything else in `dir` is left alone.
+EXPORT void NodeContext_SetCodeCache(NodeContext *context, const char *dir,
+                                     uint64_t max_bytes);
 EXPORT void NodeContext_Define_Global(NodeContext *context, const char **keys,
                                       NodeValue *values, int length);
 
 EXPORT void NodeContext_FutureUpdate(NodeContext *context, int64_t id,
-                                     NodeValue value, bool rejected);
+                                     const NodeValue *value, bool rejected);
 
-EXPORT NodeValue NodeContext_Run_Script(NodeContext *context, const char *code);
+EXPORT NodeResult *NodeContext_Run_Script(NodeContext *context,
+                                          const char *code);
+EXPORT NodeResult *NodeContext_Run_Script_As(NodeContext *context,
+                                             const char *code, int transfer);
 EXPORT NodeValue NodeContext_Create_Function(NodeContext *context,
                                              const char *function_name);
-EXPORT NodeValue NodeContext_Call_Function(NodeContext *context,
-                                           NodeValue function, NodeValue *args,
-                                           size_t args_length);
-EXPORT NodeValue NodeContext_Construct_Function(NodeContext *context,
+EXPORT NodeResult *NodeContext_Call_Function(NodeContext *context,
+                                             NodeValue function,
+                                             NodeValue *args,
+                                             size_t args_length);
+EXPORT NodeResult *NodeContext_Call_Function_As(NodeContext *context,
                                                 NodeValue function,
                                                 NodeValue *args,
-                                                size_t args_length);
+                                                size_t args_length,
+                                                int transfer);
+EXPORT NodeResult *NodeContext_Construct_Function(NodeContext *context,
+                                                  NodeValue function,
+                                                  NodeValue *args,
+                                                  size_t args_length);
+// Calls `function` once per row, each row an ARRAY holding the arguments of
+// one call, under a single lock and loop drain. The result is an ARRAY of
+// the `num_rows` return values, an ERROR_T for each row that threw.
+EXPORT NodeResult *NodeContext_Map_Function(NodeContext *context,
+                                            NodeValue function,
+                                            NodeValue *rows, size_t num_rows);
 
+EXPORT NodeResult *NodeContext_Get_Property(NodeContext *context,
+                                            NodeValue object, const char *key);
+EXPORT NodeResult *NodeContext_Get_Index(NodeContext *context,
+                                         NodeValue object, int index);
+EXPORT int NodeContext_Get_Length(NodeContext *context, NodeValue object);
+EXPORT NodeResult *NodeContext_Get_Keys(NodeContext *context,
+                                        NodeValue object);
+
+// Copies up to `capacity` pointers of Python buffers V8 no longer references
+// into `buffers` and returns how many were written.
+EXPORT int NodeContext_Drain_Released(NodeContext *context, void **buffers,
+                                      int capacity);
+
+// Non-blocking mode: bridge calls no longer drain the event loop, the
+// embedder runs it instead by calling NodeContext_Tick whenever the backend
+// fd is readable or the backend timeout (ms, -1 for none) expires.
+EXPORT void NodeContext_SetNonBlocking(NodeContext *context, bool nonblocking);
+// Pollable fd of the loop, -1 where there is none (Windows).
+EXPORT int NodeContext_Backend_Fd(NodeContext *context);
+EXPORT int NodeContext_Backend_Timeout(NodeContext *context);
+// Runs due callbacks without blocking, returns whether the loop is alive.
+EXPORT bool NodeContext_Tick(NodeContext *context);
+
+// Moves the event loop to a thread owned by the context. Commands posted
+// with NodeContext_Post_* (from any thread, without locking) run there in
+// order and complete through the completion callback, called on that thread.
+// Values passed to a post must stay valid until its completion. Posts made
+// while the thread is not running complete at once, with an ERROR_T result.
+EXPORT void NodeContext_SetCompletionCallback(NodeContext *context,
+                                              CompletionCallback cb);
+EXPORT int NodeContext_Start_Thread(NodeContext *context);
+EXPORT void NodeContext_Stop_Thread(NodeContext *context);
+// Whether the caller is the JS thread, where posting and waiting deadlocks.
+EXPORT bool NodeContext_On_Thread(NodeContext *context);
+EXPORT void NodeContext_Post_Script(NodeContext *context, int64_t id,
+                                    const char *code, int transfer);
+EXPORT void NodeContext_Post_Call(NodeContext *context, int64_t id,
+                                  NodeValue function, NodeValue *args,
+                                  size_t args_length, bool construct,
+                                  int transfer);
+EXPORT void NodeContext_Post_Map(NodeContext *context, int64_t id,
+                                 NodeValue function, NodeValue *rows,
+                                 size_t num_rows);
+EXPORT void NodeContext_Post_Define(NodeContext *context, int64_t id,
+                                    const char **keys, NodeValue *values,
+                                    int length);
+
+// CPU profiling with v8::CpuProfiler, one profile at a time per context.
+// Start samples every `sampling_interval_us` (0 for V8's 1000us). Stop writes
+// the profile as a Chrome .cpuprofile to `path` and, unless `collapsed_path`
+// is null, as collapsed stacks for flamegraphs. Both return 0 on success.
+// V8 samples the thread profiling was started on: with a JS thread, use the
+// posted variants, which complete with a boolean.
+EXPORT int NodeContext_Profile_Start(NodeContext *context,
+                                     int sampling_interval_us);
+EXPORT int NodeContext_Profile_Stop(NodeContext *context, const char *path,
+                                    const char *collapsed_path);
+EXPORT void NodeContext_Post_Profile_Start(NodeContext *context, int64_t id,
+                                           int sampling_interval_us);
+EXPORT void NodeContext_Post_Profile_Stop(NodeContext *context, int64_t id,
+                                          const char *path,
+                                          const char *collapsed_path);
 EXPORT void NodeContext_Stop(NodeContext *context);
 EXPORT void NodeContext_Destroy(NodeContext *context);
+// Frees the environment and isolate of a context, others keep running.
 EXPORT void NodeContext_Dispose(NodeContext *context);
+// Tears down Node and V8 for the whole process once every context is
+// disposed. No context can be created afterwards.
+EXPORT void Node_Shutdown();
+
+// Handles held by a context for values referenced from outside of it.
+typedef struct NodeHandleStats {
+    uint64_t live;     // not released yet
+    uint64_t slots;    // size of the table, live and free
+    uint64_t created;
+    uint64_t released;
+    uint64_t pending;  // released, freed on the next turn of the context
+    uint64_t stale;    // releases of handles that were already gone
+} NodeHandleStats;
+
+// Frees a result and its whole value tree. Handles inside the tree
+// (functions, symbols, lazy objects, buffers) are left alone, they are
+// released with NodeContext_Release_Handles by whoever kept them.
+EXPORT void Node_Release_Result(NodeResult *result);
+// Releases the val_ref of handle values, from any thread. They are freed in a
+// batch on the next call, tick or JS thread turn of the context.
+EXPORT void NodeContext_Release_Handles(NodeContext *context,
+                                        const uint64_t *refs, int count);
+// Releases the ids of JS promises whose settlement Python received, from any
+// thread. They may be given to new promises from then on.
+EXPORT void NodeContext_Release_Futures(NodeContext *context,
+                                        const int64_t *ids, int count);
+EXPORT void NodeContext_Handle_Stats(NodeContext *context,
+                                     NodeHandleStats *stats);
+
+// Heap of the isolate of a context (v8::HeapStatistics) and memory held by
+// the bridge. Cheap enough to be polled.
+typedef struct NodeMemoryStats {
+    uint64_t total_heap_size;
+    uint64_t total_heap_size_executable;
+    uint64_t total_physical_size;
+    uint64_t total_available_size;
+    uint64_t used_heap_size;
+    uint64_t heap_size_limit;
+    uint64_t malloced_memory;
+    uint64_t peak_malloced_memory;
+    uint64_t external_memory; // ArrayBuffers, external strings
+    uint64_t native_contexts;
+    uint64_t detached_contexts;
+    uint64_t live_handles;      // held by Python, see NodeHandleStats
+    uint64_t pending_futures;   // JS promise ids Python did not release
+    uint64_t pending_resolvers; // Python futures JS waits on
+    // Whole process: results not released yet, and bytes of the arenas of
+    // those and of conversions in progress.
+    uint64_t live_results;
+    uint64_t arena_bytes;
+} NodeMemoryStats;
+
+typedef struct NodeHeapSpaceStats {
+    char name[32];
+    uint64_t space_size;
+    uint64_t space_used_size;
+    uint64_t space_available_size;
+    uint64_t physical_space_size;
+} NodeHeapSpaceStats;
+
+// Timing of bridge calls is off by default and costs a branch per phase
+// then. Sites are aggregated by name, truncated to 63 bytes.
+EXPORT void NodeContext_Timing_Enable(NodeContext *context, bool enabled);
+EXPORT void NodeContext_Timing_Reset(NodeContext *context);
+// Adds a duration measured outside of the library (e.g. PHASE_PYTHON).
+EXPORT void NodeContext_Timing_Record(NodeContext *context, int kind,
+                                      const char *site, int phase,
+                                      uint64_t ns);
+// Fills up to `capacity` histograms, returns how many there are.
+EXPORT int NodeContext_Timing_Read(NodeContext *context,
+                                   NodeTimingHistogram *histograms,
+                                   int capacity);
 
-EXPORT void Node_Dispose_Value(NodeValue value);
+EXPORT void NodeContext_Memory_Stats(NodeContext *context,
+                                     NodeMemoryStats *stats);
+// Fills up to `capacity` heap spaces, returns how many the isolate has.
+EXPORT int NodeContext_Heap_Space_Stats(NodeContext *context,
+                                        NodeHeapSpaceStats *spaces,
+                                        int capacity);
+// Heap profiling with v8::HeapProfiler, also while a JS thread runs. Writes
+// a .heapsnapshot to `path`, where JS values held by the bridge are retained
+// by a "pythonodejs handles" root, through edges named after the function or
+// symbol they hold. Returns 0 on success.
+EXPORT int NodeContext_Heap_Snapshot(NodeContext *context, const char *path);
+// Samples an allocation every `sampling_interval` bytes on average (0 for
+// V8's 512K) with up to `stack_depth` frames (0 for 16). Stop writes the
+// sampled allocations still alive, by allocation site, as a .heapprofile.
+EXPORT int NodeContext_Heap_Sampling_Start(NodeContext *context,
+                                           uint64_t sampling_interval,
+                                           int stack_depth);
+EXPORT int NodeContext_Heap_Sampling_Stop(NodeContext *context,
+                                          const char *path);
+// Function name or symbol description of a handle value.
+EXPORT const char *NodeContext_Handle_Name(NodeContext *context,
+                                           NodeValue value);
+// Data and byte length of a buffer handle. The memory belongs to V8 and stays
+// valid until the handle is released and freed.
+EXPORT void *NodeContext_Buffer_Data(NodeContext *context, NodeValue value,
+                                     size_t *byte_length);
 
 #ifdef __cplusplus
 }
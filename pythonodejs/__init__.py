@@ -7,4 +7,11 @@ from .main import (
     node_dispose,
     node_stop,
     NodeRegister,
+    SharedArrayBuffer,
+    Serialized,
+    JSBigInt,
+    build_snapshot,
+    NodePool,
+    configure,
+    platform_stats,
 )
@@ -5,12 +5,28 @@ import datetime
 import platform
 import asyncio
 import ctypes
-import random
+import traceback
 import array
 import types
+import weakref
 import copy
 import os
 import re
+import subprocess
+import sys
+import json
+import itertools
+import threading
+import time
+import contextlib
+import atexit
+import concurrent.futures
+
+try:
+    from . import _binding
+except ImportError:
+    # Source checkouts without the built extension convert with ctypes.
+    _binding = None
 
 
 def _get_lib_path():
@@ -35,45 +51,137 @@ def _get_lib_path():
 _lib = ctypes.CDLL(_get_lib_path())
 
 
-# Define the NodeValue structure
+# Define the NodeValue structure (see pythonodejs.h for the payload layout)
 class NodeValue(ctypes.Structure):
     pass
 
 
+class _NodePayload(ctypes.Union):
+    _fields_ = [
+        ("val_bool", ctypes.c_bool),
+        ("val_num", ctypes.c_double),
+        ("val_int", ctypes.c_int64),
+        ("val_string", ctypes.c_char_p),
+        ("val_children", ctypes.POINTER(NodeValue)),
+        ("val_ptr", ctypes.c_void_p),
+        ("val_ref", ctypes.c_uint64),
+    ]
+
+
+NodeValue._anonymous_ = ("payload",)
 NodeValue._fields_ = [
-    ("type", ctypes.c_int),
-    ("self_ptr", ctypes.c_void_p),
-    ("val_bool", ctypes.c_bool),
-    ("val_num", ctypes.c_double),
-    ("val_string", ctypes.c_char_p),
-    ("function", ctypes.c_void_p),
-    ("val_array", ctypes.POINTER(NodeValue)),
-    ("val_tarray", ctypes.c_void_p),
-    ("val_tarray_type", ctypes.c_int),
-    ("val_array_len", ctypes.c_int),
-    ("val_big", ctypes.c_char_p),
-    ("object_keys", ctypes.POINTER(ctypes.c_char_p)),
-    ("map_keys", ctypes.POINTER(NodeValue)),
-    ("object_values", ctypes.POINTER(NodeValue)),
-    ("object_len", ctypes.c_int),
-    ("val_date_unix", ctypes.c_double),
-    ("val_regex_flags", ctypes.c_int),
-    ("val_external_ptr", ctypes.c_void_p),
-    ("future_id", ctypes.c_int64),
-    ("error_message", ctypes.c_char_p),
-    ("error_name", ctypes.c_char_p),
-    ("error_stack", ctypes.c_char_p),
-    ("proxy_target", ctypes.POINTER(NodeValue)),
-    ("proxy_handler", ctypes.POINTER(NodeValue)),
-    ("parent", ctypes.c_void_p),
+    ("type", ctypes.c_uint16),
+    ("subtype", ctypes.c_uint16),
+    ("length", ctypes.c_uint32),
+    ("payload", _NodePayload),
 ]
 
+
+# Values returned by the library live in the arena of their result
+class NodeResult(ctypes.Structure):
+    _fields_ = [("value", NodeValue), ("arena", ctypes.c_void_p)]
+
+
+# Counters of the process-wide platform, see Node_Platform_Stats
+class NodePlatformStats(ctypes.Structure):
+    _fields_ = [
+        ("platform_workers", ctypes.c_int32),
+        ("uv_threadpool_size", ctypes.c_int32),
+        ("tasks_queued", ctypes.c_uint64),
+        ("tasks_running", ctypes.c_uint64),
+        ("tasks_completed", ctypes.c_uint64),
+        ("jobs_running", ctypes.c_uint64),
+        ("uv_probe_wait_ns", ctypes.c_uint64),
+    ]
+
+
+class NodeHandleStats(ctypes.Structure):
+    _fields_ = [
+        ("live", ctypes.c_uint64),
+        ("slots", ctypes.c_uint64),
+        ("created", ctypes.c_uint64),
+        ("released", ctypes.c_uint64),
+        ("pending", ctypes.c_uint64),
+        ("stale", ctypes.c_uint64),
+    ]
+
+
+class NodeMemoryStats(ctypes.Structure):
+    _fields_ = [
+        ("total_heap_size", ctypes.c_uint64),
+        ("total_heap_size_executable", ctypes.c_uint64),
+        ("total_physical_size", ctypes.c_uint64),
+        ("total_available_size", ctypes.c_uint64),
+        ("used_heap_size", ctypes.c_uint64),
+        ("heap_size_limit", ctypes.c_uint64),
+        ("malloced_memory", ctypes.c_uint64),
+        ("peak_malloced_memory", ctypes.c_uint64),
+        ("external_memory", ctypes.c_uint64),
+        ("native_contexts", ctypes.c_uint64),
+        ("detached_contexts", ctypes.c_uint64),
+        ("live_handles", ctypes.c_uint64),
+        ("pending_futures", ctypes.c_uint64),
+        ("pending_resolvers", ctypes.c_uint64),
+        ("live_results", ctypes.c_uint64),
+        ("arena_bytes", ctypes.c_uint64),
+    ]
+
+
+class NodeHeapSpaceStats(ctypes.Structure):
+    _fields_ = [
+        ("name", ctypes.c_char * 32),
+        ("space_size", ctypes.c_uint64),
+        ("space_used_size", ctypes.c_uint64),
+        ("space_available_size", ctypes.c_uint64),
+        ("physical_space_size", ctypes.c_uint64),
+    ]
+
+
+class NodeTimingHistogram(ctypes.Structure):
+    _fields_ = [
+        ("site", ctypes.c_char * 64),
+        ("kind", ctypes.c_int32),
+        ("phase", ctypes.c_int32),
+        ("count", ctypes.c_uint64),
+        ("total_ns", ctypes.c_uint64),
+        ("max_ns", ctypes.c_uint64),
+        ("buckets", ctypes.c_uint64 * 40),
+    ]
+
+
+# Py_buffer, used to lend the memory of Python buffers to JS
+class _PyBuffer(ctypes.Structure):
+    _fields_ = [
+        ("buf", ctypes.c_void_p),
+        ("obj", ctypes.c_void_p),
+        ("len", ctypes.c_ssize_t),
+        ("itemsize", ctypes.c_ssize_t),
+        ("readonly", ctypes.c_int),
+        ("ndim", ctypes.c_int),
+        ("format", ctypes.c_char_p),
+        ("shape", ctypes.c_void_p),
+        ("strides", ctypes.c_void_p),
+        ("suboffsets", ctypes.c_void_p),
+        ("internal", ctypes.c_void_p),
+    ]
+
+
+_PyObject_GetBuffer = ctypes.pythonapi.PyObject_GetBuffer
+_PyObject_GetBuffer.restype = ctypes.c_int
+_PyObject_GetBuffer.argtypes = [
+    ctypes.py_object,
+    ctypes.POINTER(_PyBuffer),
+    ctypes.c_int,
+]
+_PyBuffer_Release = ctypes.pythonapi.PyBuffer_Release
+_PyBuffer_Release.restype = None
+_PyBuffer_Release.argtypes = [ctypes.POINTER(_PyBuffer)]
+
 CALLBACK = ctypes.CFUNCTYPE(
     ctypes.c_void_p, ctypes.c_char_p, ctypes.POINTER(NodeValue), ctypes.c_int
 )
-FUTURE_CALLBACK = ctypes.CFUNCTYPE(
-    ctypes.c_void_p, ctypes.c_int64, NodeValue, ctypes.c_bool
-)
+FUTURE_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.POINTER(NodeResult))
+COMPLETION_CALLBACK = ctypes.CFUNCTYPE(None, ctypes.c_int64, ctypes.POINTER(NodeResult))
 
 # Set function signatures
 _lib.NodeContext_Create.restype = ctypes.c_void_p
@@ -94,12 +202,34 @@ _lib.NodeContext_Init.argtypes = [
     ctypes.c_int,
 ]
 
+_lib.NodeContext_SetSnapshot.restype = None
+_lib.NodeContext_SetSnapshot.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+
+_lib.NodeContext_Build_Snapshot.restype = ctypes.c_int
+_lib.NodeContext_Build_Snapshot.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_char_p,
+    ctypes.POINTER(ctypes.c_char_p),
+    ctypes.c_int,
+    ctypes.c_char_p,
+]
+
 _lib.NodeContext_SetCallback.restype = None
 _lib.NodeContext_SetCallback.argtypes = [ctypes.c_void_p, CALLBACK]
 
 _lib.NodeContext_SetFutureCallback.restype = None
 _lib.NodeContext_SetFutureCallback.argtypes = [ctypes.c_void_p, FUTURE_CALLBACK]
 
+_lib.NodeContext_SetLazy.restype = None
+_lib.NodeContext_SetLazy.argtypes = [ctypes.c_void_p, ctypes.c_bool]
+
+_lib.NodeContext_SetCodeCache.restype = None
+_lib.NodeContext_SetCodeCache.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_char_p,
+    ctypes.c_uint64,
+]
+
 _lib.NodeContext_Define_Global.restype = None
 _lib.NodeContext_Define_Global.argtypes = [
     ctypes.c_void_p,
@@ -116,13 +246,20 @@ _lib.NodeContext_FutureUpdate.argtypes = [
     ctypes.c_bool,
 ]
 
-_lib.NodeContext_Run_Script.restype = NodeValue
+_lib.NodeContext_Run_Script.restype = ctypes.POINTER(NodeResult)
 _lib.NodeContext_Run_Script.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
 
+_lib.NodeContext_Run_Script_As.restype = ctypes.POINTER(NodeResult)
+_lib.NodeContext_Run_Script_As.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_char_p,
+    ctypes.c_int,
+]
+
 _lib.NodeContext_Create_Function.restype = NodeValue
 _lib.NodeContext_Create_Function.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
 
-_lib.NodeContext_Call_Function.restype = NodeValue
+_lib.NodeContext_Call_Function.restype = ctypes.POINTER(NodeResult)
 _lib.NodeContext_Call_Function.argtypes = [
     ctypes.c_void_p,
     NodeValue,
@@ -130,7 +267,16 @@ _lib.NodeContext_Call_Function.argtypes = [
     ctypes.c_size_t,
 ]
 
-_lib.NodeContext_Construct_Function.restype = NodeValue
+_lib.NodeContext_Call_Function_As.restype = ctypes.POINTER(NodeResult)
+_lib.NodeContext_Call_Function_As.argtypes = [
+    ctypes.c_void_p,
+    NodeValue,
+    ctypes.POINTER(NodeValue),
+    ctypes.c_size_t,
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Construct_Function.restype = ctypes.POINTER(NodeResult)
 _lib.NodeContext_Construct_Function.argtypes = [
     ctypes.c_void_p,
     NodeValue,
@@ -138,6 +284,132 @@ _lib.NodeContext_Construct_Function.argtypes = [
     ctypes.c_size_t,
 ]
 
+_lib.NodeContext_Map_Function.restype = ctypes.POINTER(NodeResult)
+_lib.NodeContext_Map_Function.argtypes = [
+    ctypes.c_void_p,
+    NodeValue,
+    ctypes.POINTER(NodeValue),
+    ctypes.c_size_t,
+]
+
+_lib.NodeContext_Get_Property.restype = ctypes.POINTER(NodeResult)
+_lib.NodeContext_Get_Property.argtypes = [ctypes.c_void_p, NodeValue, ctypes.c_char_p]
+
+_lib.NodeContext_Get_Index.restype = ctypes.POINTER(NodeResult)
+_lib.NodeContext_Get_Index.argtypes = [ctypes.c_void_p, NodeValue, ctypes.c_int]
+
+_lib.NodeContext_Get_Length.restype = ctypes.c_int
+_lib.NodeContext_Get_Length.argtypes = [ctypes.c_void_p, NodeValue]
+
+_lib.NodeContext_Get_Keys.restype = ctypes.POINTER(NodeResult)
+_lib.NodeContext_Get_Keys.argtypes = [ctypes.c_void_p, NodeValue]
+
+_lib.NodeContext_Drain_Released.restype = ctypes.c_int
+_lib.NodeContext_Drain_Released.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_void_p),
+    ctypes.c_int,
+]
+
+_lib.NodeContext_SetNonBlocking.restype = None
+_lib.NodeContext_SetNonBlocking.argtypes = [ctypes.c_void_p, ctypes.c_bool]
+
+_lib.NodeContext_Backend_Fd.restype = ctypes.c_int
+_lib.NodeContext_Backend_Fd.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_Backend_Timeout.restype = ctypes.c_int
+_lib.NodeContext_Backend_Timeout.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_Tick.restype = ctypes.c_bool
+_lib.NodeContext_Tick.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_SetCompletionCallback.restype = None
+_lib.NodeContext_SetCompletionCallback.argtypes = [ctypes.c_void_p, COMPLETION_CALLBACK]
+
+_lib.NodeContext_Start_Thread.restype = ctypes.c_int
+_lib.NodeContext_Start_Thread.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_Stop_Thread.restype = None
+_lib.NodeContext_Stop_Thread.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_On_Thread.restype = ctypes.c_bool
+_lib.NodeContext_On_Thread.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_Post_Script.restype = None
+_lib.NodeContext_Post_Script.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int64,
+    ctypes.c_char_p,
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Post_Call.restype = None
+_lib.NodeContext_Post_Call.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int64,
+    NodeValue,
+    ctypes.POINTER(NodeValue),
+    ctypes.c_size_t,
+    ctypes.c_bool,
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Post_Map.restype = None
+_lib.NodeContext_Post_Map.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int64,
+    NodeValue,
+    ctypes.POINTER(NodeValue),
+    ctypes.c_size_t,
+]
+
+_lib.NodeContext_Post_Define.restype = None
+_lib.NodeContext_Post_Define.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int64,
+    ctypes.POINTER(ctypes.c_char_p),
+    ctypes.POINTER(NodeValue),
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Profile_Start.restype = ctypes.c_int
+_lib.NodeContext_Profile_Start.argtypes = [ctypes.c_void_p, ctypes.c_int]
+
+_lib.NodeContext_Profile_Stop.restype = ctypes.c_int
+_lib.NodeContext_Profile_Stop.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_char_p,
+    ctypes.c_char_p,
+]
+
+_lib.NodeContext_Post_Profile_Start.restype = None
+_lib.NodeContext_Post_Profile_Start.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int64,
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Post_Profile_Stop.restype = None
+_lib.NodeContext_Post_Profile_Stop.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int64,
+    ctypes.c_char_p,
+    ctypes.c_char_p,
+]
+
+_lib.NodeContext_Heap_Snapshot.restype = ctypes.c_int
+_lib.NodeContext_Heap_Snapshot.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+
+_lib.NodeContext_Heap_Sampling_Start.restype = ctypes.c_int
+_lib.NodeContext_Heap_Sampling_Start.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_uint64,
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Heap_Sampling_Stop.restype = ctypes.c_int
+_lib.NodeContext_Heap_Sampling_Stop.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+
 _lib.NodeContext_Stop.restype = None
 _lib.NodeContext_Stop.argtypes = [ctypes.c_void_p]
 
@@ -147,8 +419,87 @@ _lib.NodeContext_Destroy.argtypes = [ctypes.c_void_p]
 _lib.NodeContext_Dispose.restype = None
 _lib.NodeContext_Dispose.argtypes = [ctypes.c_void_p]
 
-_lib.Node_Dispose_Value.restype = None
-_lib.Node_Dispose_Value.argtypes = [NodeValue]
+_lib.Node_Shutdown.restype = None
+_lib.Node_Shutdown.argtypes = []
+
+_lib.Node_Release_Result.restype = None
+_lib.Node_Release_Result.argtypes = [ctypes.POINTER(NodeResult)]
+
+_lib.NodeContext_Release_Handles.restype = None
+_lib.NodeContext_Release_Handles.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_uint64),
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Release_Futures.restype = None
+_lib.NodeContext_Release_Futures.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(ctypes.c_int64),
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Handle_Stats.restype = None
+_lib.NodeContext_Handle_Stats.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(NodeHandleStats),
+]
+
+_lib.NodeContext_Timing_Enable.restype = None
+_lib.NodeContext_Timing_Enable.argtypes = [ctypes.c_void_p, ctypes.c_bool]
+
+_lib.NodeContext_Timing_Reset.restype = None
+_lib.NodeContext_Timing_Reset.argtypes = [ctypes.c_void_p]
+
+_lib.NodeContext_Timing_Record.restype = None
+_lib.NodeContext_Timing_Record.argtypes = [
+    ctypes.c_void_p,
+    ctypes.c_int,
+    ctypes.c_char_p,
+    ctypes.c_int,
+    ctypes.c_uint64,
+]
+
+_lib.NodeContext_Timing_Read.restype = ctypes.c_int
+_lib.NodeContext_Timing_Read.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(NodeTimingHistogram),
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Memory_Stats.restype = None
+_lib.NodeContext_Memory_Stats.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(NodeMemoryStats),
+]
+
+_lib.NodeContext_Heap_Space_Stats.restype = ctypes.c_int
+_lib.NodeContext_Heap_Space_Stats.argtypes = [
+    ctypes.c_void_p,
+    ctypes.POINTER(NodeHeapSpaceStats),
+    ctypes.c_int,
+]
+
+_lib.NodeContext_Handle_Name.restype = ctypes.c_char_p
+_lib.NodeContext_Handle_Name.argtypes = [ctypes.c_void_p, NodeValue]
+
+_lib.NodeContext_Buffer_Data.restype = ctypes.c_void_p
+_lib.NodeContext_Buffer_Data.argtypes = [
+    ctypes.c_void_p,
+    NodeValue,
+    ctypes.POINTER(ctypes.c_size_t),
+]
+
+_lib.Node_Configure.restype = ctypes.c_int
+_lib.Node_Configure.argtypes = [
+    ctypes.c_int,
+    ctypes.c_int,
+    ctypes.POINTER(ctypes.c_int),
+    ctypes.c_int,
+]
+
+_lib.Node_Platform_Stats.restype = None
+_lib.Node_Platform_Stats.argtypes = [ctypes.POINTER(NodePlatformStats)]
 
 _import_pattern = re.compile(r"(?<![\w])import\(([^)]+)\)")
 
@@ -177,7 +528,23 @@ MODULE_NAMESPACE = 20
 ERROR_T = 21
 PROMISE = 22
 SET = 23
-RETURN = 24
+LAZY_OBJECT = 24
+LAZY_ARRAY = 25
+SHARED_ARRAY_BUFFER = 26
+JSON_T = 27
+SERIALIZED = 28
+STRING_ONE_BYTE = 29
+STRING_TWO_BYTE = 30
+
+# NodeTransfer, how results cross from JS
+_TRANSFERS = {None: 0, "tree": 0, "json": 1, "clone": 2}
+
+# NodeTimingKind and NodeTimingPhase
+TIMING_SCRIPT, TIMING_CALL, TIMING_CONSTRUCT, TIMING_CALLBACK = range(4)
+TIMING_SETTLE, TIMING_RESOLVE = 4, 5
+_TIMING_KINDS = ("script", "call", "construct", "callback", "settle", "resolve")
+PHASE_PYTHON = 4
+_TIMING_PHASES = ("args", "run", "loop", "result", "python")
 
 
 INT8_T = 0
@@ -191,39 +558,56 @@ BUINT64_T = 7
 FLOAT32_T = 8
 FLOAT64_T = 9
 
-
-def random_int64():
-    val = random.getrandbits(64)
-    if val >= 2**63:
-        val -= 2**64
-    return val
+_TYPED_ARRAY_CODES = {
+    INT8_T: "b",
+    UINT8_T: "B",
+    INT16_T: "h",
+    UINT16_T: "H",
+    INT32_T: "i",
+    UINT32_T: "I",
+    BINT64_T: "q",
+    BUINT64_T: "Q",
+    FLOAT32_T: "f",
+    FLOAT64_T: "d",
+}
+_TYPED_ARRAY_KINDS = {code: kind for kind, code in _TYPED_ARRAY_CODES.items()}
+# "l" and "L" are 4 bytes on Windows and 8 bytes elsewhere.
+_TYPED_ARRAY_KINDS["l"] = BINT64_T if array.array("l").itemsize == 8 else INT32_T
+_TYPED_ARRAY_KINDS["L"] = BUINT64_T if array.array("L").itemsize == 8 else UINT32_T
 
 
 class JSValue:
-    def __init__(self, nv):
+    def __init__(self, nv=None):
         self._nv = nv
 
 
+class JSError(Exception):
+    """A JS Error converted to a Python exception."""
+
+    def __init__(self, message="", name="Error", stack=""):
+        super().__init__(message)
+        self.message = message
+        self.name = name
+        self.stack = stack
+
+    def __str__(self):
+        return f"{self.name}: {self.message}"
+
+
 class NativeArray(list, JSValue):
-    def __init__(self, nv, iterable=()):
+    def __init__(self, nv=None, iterable=()):
         list.__init__(self, iterable)
         JSValue.__init__(self, nv)
 
-    def __del__(self):
-        _lib.Node_Dispose_Value(self._nv)
-
 
 class NativeSet(set, JSValue):
-    def __init__(self, nv, *args):
+    def __init__(self, nv=None, *args):
         set.__init__(self, *args)
         JSValue.__init__(self, nv)
 
-    def __del__(self):
-        _lib.Node_Dispose_Value(self._nv)
-
 
 class NativeObject(dict, JSValue):
-    def __init__(self, nv, *args, **kwargs):
+    def __init__(self, nv=None, *args, **kwargs):
         dict.__init__(self, *args, **kwargs)
         JSValue.__init__(self, nv)
 
@@ -231,7 +615,7 @@ class NativeObject(dict, JSValue):
         try:
             value = self[name]
             if isinstance(value, dict) and not isinstance(value, NativeObject):
-                value = NativeObject(self._nv, value)
+                value = NativeObject(None, value)
                 self[name] = value
             return value
         except KeyError:
@@ -243,54 +627,145 @@ class NativeObject(dict, JSValue):
         else:
             self[name] = value
 
-    def __del__(self):
-        _lib.Node_Dispose_Value(self._nv)
 
+class LazyObject(JSValue):
+    """
+    A JS object that stays in the node context. Properties are converted the
+    first time they are read and cached on the wrapper. Like a dict, reading
+    a key the object does not have raises KeyError, while keys holding null
+    or undefined read as None.
+    """
 
-class NativeDatetime(datetime.datetime, JSValue):
-    def __init__(self, nv, *args, **kwargs):
-        if len(args) == 1 and isinstance(args[0], datetime.datetime):
-            dt = args[0]
-            args = (
-                dt.year,
-                dt.month,
-                dt.day,
-                dt.hour,
-                dt.minute,
-                dt.second,
-                dt.microsecond,
-            )
-        elif len(args) == 1 and isinstance(args[0], (int, float)):
-            dt = datetime.datetime.fromtimestamp(args[0])
-            args = (
-                dt.year,
-                dt.month,
-                dt.day,
-                dt.hour,
-                dt.minute,
-                dt.second,
-                dt.microsecond,
+    def __init__(self, node, nv):
+        super().__init__(nv)
+        self._node = node
+        self._cache = {}
+        self._keys = None
+        self._key_set = None
+
+    def __getitem__(self, key):
+        if key in self._cache:
+            return self._cache[key]
+        if key not in self:
+            raise KeyError(key)
+        value = _consume(
+            self._node,
+            _lib.NodeContext_Get_Property(
+                self._node._context, self._nv, str(key).encode("utf-8")
+            ),
+        )
+        self._cache[key] = value
+        return value
+
+    def __getattr__(self, name):
+        if name.startswith("_"):
+            raise AttributeError(name)
+        try:
+            return self[name]
+        except KeyError:
+            raise AttributeError(name) from None
+
+    def keys(self):
+        if self._keys is None:
+            self._keys = list(
+                _consume(
+                    self._node, _lib.NodeContext_Get_Keys(self._node._context, self._nv)
+                )
             )
+        return self._keys
 
-        datetime.datetime.__init__(self, *args, **kwargs)
-        JSValue.__init__(self, nv)
+    def values(self):
+        return [self[key] for key in self.keys()]
+
+    def items(self):
+        return [(key, self[key]) for key in self.keys()]
+
+    def get(self, key, default=None):
+        return self[key] if key in self else default
+
+    def __contains__(self, key):
+        if self._key_set is None:
+            self._key_set = set(self.keys())
+        return key in self._key_set
+
+    def __iter__(self):
+        return iter(self.keys())
+
+    def __len__(self):
+        return len(self.keys())
+
+    def __bool__(self):
+        return True
+
+    def __repr__(self):
+        return f"LazyObject({len(self._cache)}/{len(self.keys())} loaded)"
 
     def __del__(self):
-        _lib.Node_Dispose_Value(self._nv)
+        self._node._release_handle(self._nv.val_ref)
+
+
+class LazyArray(JSValue):
+    """
+    A JS array that stays in the node context. Elements are converted the
+    first time they are read and cached on the wrapper.
+    """
+
+    def __init__(self, node, nv):
+        super().__init__(nv)
+        self._node = node
+        self._cache = {}
+        self._length = nv.length
+
+    def __getitem__(self, index):
+        if isinstance(index, slice):
+            return [self[i] for i in range(*index.indices(self._length))]
+        if index < 0:
+            index += self._length
+        if index < 0 or index >= self._length:
+            raise IndexError("list index out of range")
+        if index in self._cache:
+            return self._cache[index]
+        value = _consume(
+            self._node,
+            _lib.NodeContext_Get_Index(self._node._context, self._nv, index),
+        )
+        self._cache[index] = value
+        return value
+
+    def __iter__(self):
+        for i in range(self._length):
+            yield self[i]
+
+    def __len__(self):
+        return self._length
+
+    def __bool__(self):
+        return self._length > 0
+
+    def __repr__(self):
+        return f"LazyArray({len(self._cache)}/{self._length} loaded)"
+
+    def __del__(self):
+        self._node._release_handle(self._nv.val_ref)
+
+
+class NativeDatetime(datetime.datetime, JSValue):
+    """A JS Date converted to a datetime."""
 
 
 class NativePattern(JSValue):
     def __init__(self, nv, *args, **kwargs):
         if len(args) == 1 and isinstance(args[0], re.Pattern):
-            self._target = args[0]
+            target = args[0]
         else:
-            self._target = re.Pattern(*args, **kwargs)
-        super().__init__(nv)
+            target = re.compile(*args, **kwargs)
+        object.__setattr__(self, "_target", target)
+        object.__setattr__(self, "_nv", nv)
 
     def __getattribute__(self, name):
-        if name == "_target":
-            return self._target
-        return getattr(self._target, name)
+        if name in ("_target", "_nv"):
+            return object.__getattribute__(self, name)
+        return getattr(object.__getattribute__(self, "_target"), name)
 
     def __setattr__(self, name, value):
         setattr(self._target, name, value)
@@ -298,9 +773,6 @@ class NativePattern(JSValue):
     def __delattr__(self, name):
         delattr(self._target, name)
 
-    def __del__(self):
-        _lib.Node_Dispose_Value(self._nv)
-
     def __repr__(self):
         return repr(self._target)
 
@@ -317,12 +789,12 @@ class NativePattern(JSValue):
         return self._target.__reduce__()
 
     def __copy__(self):
-        return type(self)(self._target)
+        return type(self)(self._nv, self._target)
 
     def __deepcopy__(self, memo):
         import copy
 
-        return type(self)(copy.deepcopy(self._target, memo))
+        return type(self)(self._nv, copy.deepcopy(self._target, memo))
 
     def __class_getitem__(cls, item):
         return re.Pattern[item]
@@ -334,68 +806,150 @@ class Func(JSValue):
         self._node = node
         self.__name__ = name
 
-    def __call__(self, *args, **kwargs):
+    def _args(self, args, transfer=None):
+        if transfer != "json":
+            return _children(self._node, args)
         L = len(args)
         n_args = (NodeValue * L)()
         for i in range(L):
-            n_args[i] = _to_node(self._node, args[i])
-        return _to_python(
+            n_args[i].type = JSON_T
+            _set_string(n_args[i], json.dumps(args[i]))
+        return n_args
+
+    def __call__(self, *args, transfer=None, **kwargs):
+        """
+        Args:
+            transfer: "json" sends each argument and returns the result as one
+                JSON buffer, much faster than a tree of values for large plain
+                data. "clone" returns the result as a Serialized structured
+                clone. None converts values one by one.
+        """
+        if self._node._threaded():
+            return self._node.submit_call(self, *args, transfer=transfer).result()
+        return _consume(
             self._node,
-            _lib.NodeContext_Call_Function(
-                self._node._context, self._nv, n_args, len(args)
+            _lib.NodeContext_Call_Function_As(
+                self._node._context,
+                self._nv,
+                self._args(args, transfer),
+                len(args),
+                _TRANSFERS[transfer],
+            ),
+            (TIMING_CALL, self.__name__),
+        )
+
+    def _rows(self, rows):
+        rows = list(rows)
+        n_rows = (NodeValue * len(rows))()
+        for i, row in enumerate(rows):
+            if not isinstance(row, tuple):
+                row = (row,)
+            n_rows[i].type = ARRAY
+            n_rows[i].length = len(row)
+            n_rows[i].val_children = self._args(row)
+        return n_rows
+
+    def map(self, rows) -> list:
+        """
+        Calls the function once per row and returns the results in order. A
+        tuple row holds the arguments of its call, any other row is passed as
+        the only argument. The whole batch runs under one lock and one event
+        loop drain, much cheaper than calling in a Python loop. A row that
+        throws gives its JSError in place of a result.
+        """
+        n_rows = self._rows(rows)
+        if self._node._threaded():
+            return self._node.submit_map(self, n_rows).result()
+        return _consume(
+            self._node,
+            _lib.NodeContext_Map_Function(
+                self._node._context, self._nv, n_rows, len(n_rows)
             ),
         )
 
     def new(self, *args, **kwargs):
-        L = len(args)
-        n_args = (NodeValue * L)()
-        for i in range(L):
-            n_args[i] = _to_node(self._node, args[i])
-        return _to_python(
+        if self._node._threaded():
+            return self._node.submit_call(self, *args, construct=True).result()
+        return _consume(
             self._node,
             _lib.NodeContext_Construct_Function(
-                self._node._context, self._nv, n_args, len(args)
+                self._node._context, self._nv, self._args(args), len(args)
             ),
+            (TIMING_CONSTRUCT, self.__name__),
         )
 
     def __str__(self):
         return f"{self.__name__}@Node"
 
     def __del__(self):
-        _lib.Node_Dispose_Value(self._nv)
+        self._node._release_handle(self._nv.val_ref)
 
 
 class JSExternal:
     def __init__(self, ptr):
         self._ptr = ptr
 
-    def __getattr__(self, name):
-        try:
-            value = self[name]
-            if isinstance(value, dict) and not isinstance(value, NativeObject):
-                value = NativeObject(self._nv, value)
-                self[name] = value
-            return value
-        except KeyError:
-            raise AttributeError(name)
 
-    def __setattr__(self, name, value):
-        if name.startswith("_") or name in self.__dict__:
-            super().__setattr__(name, value)
-        else:
-            self[name] = value
+class Serialized(bytes):
+    """
+    A JS value serialized with V8's structured clone, returned by calls made
+    with transfer="clone". Passing it back as an argument, to any context,
+    deserializes it in JS.
+    """
 
 
-class JSSymbol:
-    def __init__(self, ptr, description):
-        self._ptr = ptr
+class SharedArrayBuffer:
+    """
+    Memory shared between Python and JS. Passed to JS it becomes a
+    SharedArrayBuffer over the same memory, so JS (using Atomics) and Python
+    threads can exchange data through it without going through the bridge.
+    SharedArrayBuffers returned from JS are wrapped the same way.
+
+    Args:
+        source: A size in bytes to allocate, or a writable contiguous buffer
+            (bytearray, mmap, multiprocessing.shared_memory buffers...).
+    """
+
+    def __init__(self, source: Union[int, Any]):
+        if isinstance(source, int):
+            source = bytearray(source)
+        memory = memoryview(source)
+        if memory.readonly:
+            raise TypeError("SharedArrayBuffer memory must be writable")
+        self.memory = memory.cast("B")
+
+    def cast(self, fmt: str) -> memoryview:
+        return self.memory.cast(fmt)
+
+    def __len__(self):
+        return self.memory.nbytes
+
+    def __repr__(self):
+        return f"SharedArrayBuffer({len(self)})"
+
+
+class JSBigInt(int):
+    """
+    A JS BigInt, sent back to JS as a BigInt. Plain ints are always sent as
+    numbers, wrap them in JSBigInt to keep integers beyond 2**53 exact.
+    """
+
+
+class JSSymbol(JSValue):
+    def __init__(self, nv, description=None, node=None):
+        super().__init__(nv)
         self.description = description
+        self._node = node
 
     def __str__(self):
         if self.description:
             return f"Symbol({self.description})"
         return f"Symbol"
 
+    def __del__(self):
+        if self._node is not None:
+            self._node._release_handle(self._nv.val_ref)
+
 
 class JSProxy(JSValue):
     def __init__(self, nv, target, handler):
@@ -404,250 +958,352 @@ class JSProxy(JSValue):
         self._handler = handler
 
 
-def _to_node(node, value):  # TODO SYMBOL
+def _copy(value: NodeValue) -> NodeValue:
+    # Values inside a result tree point into memory that is released once the
+    # tree is consumed, handles keep their own copy.
+    return NodeValue.from_buffer_copy(value)
+
+
+def _string(value: NodeValue, encoding="utf-8") -> str:
+    if not value.length:
+        return ""
+    return ctypes.string_at(value.val_ptr, value.length).decode(encoding)
+
+
+def _set_string(v: NodeValue, value: str):
+    data = value.encode("utf-8")
+    v.val_string = data
+    v.length = len(data)
+
+
+def _key(node, value: NodeValue) -> str:
+    # Interned keys are decoded once per context and the same str is reused.
+    if not value.subtype:
+        return _string(value)
+    key = node._keys.get(value.subtype)
+    if key is None:
+        key = node._keys[value.subtype] = _string(value)
+        node._key_ids[key] = value.subtype
+    return key
+
+
+def _object(node, value: dict) -> NodeValue:
     v = NodeValue()
-    if not value:
+    v.type = OBJECT
+    v.length = len(value)
+    pairs = (NodeValue * (len(value) * 2))()
+    key_ids = node._key_ids
+    for i, (key, item) in enumerate(value.items()):
+        k = pairs[i * 2]
+        k.type = STRING
+        k.subtype = key_ids.get(key, 0)
+        if not k.subtype:
+            _set_string(k, key)
+        pairs[i * 2 + 1] = _to_node(node, item)
+    v.val_children = pairs
+    return v
+
+
+def _set_bigint(v: NodeValue, value: int):
+    v.type = BIGINT
+    if -(2**63) <= value < 2**63:
+        v.val_int = value
+        return
+    magnitude = abs(value)
+    count = (magnitude.bit_length() + 63) // 64
+    v.val_string = magnitude.to_bytes(count * 8, "little")
+    v.length = count
+    v.subtype = value < 0
+
+
+def _bigint(value: NodeValue) -> JSBigInt:
+    if not value.length:
+        return JSBigInt(value.val_int)
+    words = ctypes.string_at(value.val_ptr, value.length * 8)
+    magnitude = int.from_bytes(words, "little")
+    return JSBigInt(-magnitude if value.subtype else magnitude)
+
+
+def _buffer(node, value: NodeValue, fmt: str) -> memoryview:
+    """
+    Exposes the V8 backing store of a buffer handle without copying it. The
+    handle is released once every view on the memory is gone.
+    """
+    size = ctypes.c_size_t()
+    data = _lib.NodeContext_Buffer_Data(node._context, value, ctypes.byref(size))
+    if not data or not size.value:
+        node._release_handle(value.val_ref)
+        return memoryview(bytearray()).cast(fmt)
+    memory = (ctypes.c_char * size.value).from_address(data)
+    weakref.finalize(memory, node._release_handle, value.val_ref)
+    return memoryview(memory).cast("B").cast(fmt)
+
+
+def _is_buffer(value) -> bool:
+    try:
+        memoryview(value)
+    except TypeError:
+        return False
+    return True
+
+
+def _children(node, values):
+    if _binding is not None:
+        return _to_nodes(node, values)
+    values = list(values)
+    L = len(values)
+    arr = (NodeValue * L)()
+    for i in range(L):
+        arr[i] = _to_node(node, values[i])
+    return arr
+
+
+def _to_node(node, value):
+    v = NodeValue()
+    if value is None:
         v.type = NULL_T
+    elif isinstance(value, Func):
+        v.type = FUNCTION
+        v.val_ref = value._nv.val_ref
+    elif isinstance(value, (LazyObject, LazyArray, JSSymbol)):
+        v.type = value._nv.type
+        v.length = value._nv.length
+        v.val_ref = value._nv.val_ref
     elif isinstance(value, bool):
         v.type = BOOLEAN_T
-        v.val_bool = bool(value)
-    elif isinstance(value, int):
+        v.val_bool = value
+    elif isinstance(value, JSBigInt):
+        _set_bigint(v, value)
+    elif isinstance(value, (int, float)):
         v.type = NUMBER
         v.val_num = value
     elif isinstance(value, str):
         v.type = STRING
-        v.val_string = value.encode("utf-8")
+        _set_string(v, value)
     elif isinstance(value, datetime.datetime):
         v.type = DATE_T
-        v.val_date_unix = value.timestamp()
+        v.val_num = value.timestamp() * 1000
     elif isinstance(value, JSExternal):
         v.type = EXTERNAL
-        v.val_external_ptr = value._ptr
-    elif isinstance(value, JSSymbol):
-        v.type = SYMBOL
-        v.val_external_ptr = value._ptr
-        if value.description:
-            v.val_string = value.description.encode("utf-8")
-    elif isinstance(value, re.Pattern):
+        v.val_ptr = value._ptr
+    elif isinstance(value, (re.Pattern, NativePattern)):
+        if isinstance(value, NativePattern):
+            value = value._target
         v.type = REGEXP
-        v.val_string = value.pattern.encode("utf-8")
+        _set_string(v, value.pattern)
         flags = 0
         if value.flags & re.IGNORECASE:
             flags |= 1 << 1  # kIgnoreCase
         if value.flags & re.MULTILINE:
             flags |= 1 << 2  # kMultiline
-        if value.flags & re.UNICODE:
-            flags |= 1 << 4  # kUnicode
         if value.flags & re.DOTALL:
             flags |= 1 << 5  # kDotAll
-        v.val_regex_flags = flags
+        v.subtype = flags
     elif isinstance(value, Coroutine):
         v.type = PROMISE
-        cid = random_int64()
-        v.future_id = cid
-        node._tracker.track(value, cid)
-    elif isinstance(value, JSExternal):
-        v.type = EXTERNAL
-        v.val_external_ptr = value._ptr
-    elif isinstance(value, datetime.datetime):
-        v.type = DATE_T
-        v.val_date_unix = value.timestamp()
+        v.val_int = node._future_id()
+        node._tracker.track(value, v.val_int)
     elif isinstance(value, BaseException):
         v.type = ERROR_T
-        v.error_message = str(value)
-        v.error_name = type(value).__name__
-        v.error_stack = str(getattr(value, "__traceback__", None))
-    elif isinstance(value, (list, tuple, set)):  # Same for set
+        v.length = 3
+        v.val_children = _children(
+            node,
+            [
+                str(value),
+                type(value).__name__,
+                "".join(
+                    traceback.format_exception(type(value), value, value.__traceback__)
+                ),
+            ],
+        )
+    elif isinstance(value, (list, tuple, set)):
         v.type = SET if isinstance(value, set) else ARRAY
-        val = list(value)
-        L = len(value)
-        arr = (NodeValue * L)()
-        for i in range(L):
-            arr[i] = _to_node(node, val[i])
-        v.val_array_len = L
-        v.val_array = arr
-    elif isinstance(value, array.array):  # Same for set
-        v.type = TYPED_ARRAY
-        items = list(value)
-        L = len(value)
-
-        kind = INT8_T
-        c_kind = ctypes.c_int8
-        if value.typecode == "B":
-            kind = UINT8_T
-            c_kind = ctypes.c_uint8
-        elif value.typecode == "h":
-            kind = INT16_T
-            c_kind = ctypes.c_int16
-        elif value.typecode == "H":
-            kind = UINT16_T
-            c_kind = ctypes.c_uint16
-        elif value.typecode == "i":
-            kind = INT32_T
-            c_kind = ctypes.c_int32
-        elif value.typecode == "I":
-            kind = UINT32_T
-            c_kind = ctypes.c_uint32
-        elif value.typecode == "l":
-            kind = BINT64_T
-            c_kind = ctypes.c_int64
-        elif value.typecode == "L":
-            kind = BUINT64_T
-            c_kind = ctypes.c_uint64
-        elif value.typecode == "f":
-            kind = FLOAT32_T
-            c_kind = ctypes.c_float
-        elif value.typecode == "d":
-            kind = FLOAT64_T
-            c_kind = ctypes.c_double
-
-        arr = (c_kind * L)()
-        for i in range(L):
-            arr[i] = c_kind(val[i])
-        v.val_array_len = L
-        v.val_tarray_type = kind
-        v.val_tarray = arr
+        v.length = len(value)
+        v.val_children = _children(node, list(value))
+    elif isinstance(value, SharedArrayBuffer):
+        v.type = SHARED_ARRAY_BUFFER
+        v.length = len(value)
+        v.val_ptr = node._borrow(value.memory)
+    elif isinstance(value, Serialized):
+        v.type = SERIALIZED
+        v.length = len(value)
+        v.val_string = value
+    elif isinstance(value, (bytes, bytearray)):
+        v.type = ARRAY_BUFFER
+        v.length = len(value)
+        v.val_ptr = node._borrow(memoryview(value))
+    elif isinstance(value, (memoryview, array.array)) or _is_buffer(value):
+        # array.array, numpy arrays and other typed buffers keep their type.
+        view = memoryview(value)
+        fmt = view.format.lstrip("@=")
+        if fmt in _TYPED_ARRAY_KINDS:
+            v.type = TYPED_ARRAY
+            v.subtype = _TYPED_ARRAY_KINDS[fmt]
+        else:
+            v.type = ARRAY_BUFFER
+        v.length = view.nbytes
+        v.val_ptr = node._borrow(view)
     elif isinstance(value, dict):
+        if all(isinstance(x, str) for x in value):
+            return _object(node, value)
         keys = list(value.keys())
-        is_map = any(not isinstance(x, str) for x in keys)
-        v.type = MAP if is_map else OBJECT
-        L = len(value)
-        values = (NodeValue * L)()
-        for i in range(L):
-            values[i] = _to_node(node, value[keys[i]])
-        v.object_len = L
-        v.object_values = values
-        if is_map:
-            n_keys = (NodeValue * L)()
-            for i in range(L):
-                n_keys[i] = _to_node(node, keys[i])
-            v.map_keys = n_keys
-        else:
-            keys = [key.encode("utf-8") for key in keys]
-            n_keys = (ctypes.c_char_p * L)(*keys)
-            v.object_keys = n_keys
+        v.type = MAP
+        v.length = len(keys)
+        pairs = []
+        for key in keys:
+            pairs.append(key)
+            pairs.append(value[key])
+        v.val_children = _children(node, pairs)
     elif callable(value):
-        name_enc = value.__name__.encode("utf-8")
         fun = node._create_function(value)
         v.type = FUNCTION
-        v.val_string = name_enc
-        v.function = fun.function
+        v.val_ref = fun.val_ref
     else:
         v.type = STRING
-        v.val_string = value.__str__().encode("utf-8")
+        _set_string(v, value.__str__())
     return v
 
 
-def _to_python(node, value: NodeValue):  # TODO SYMBOL
+def _to_python(node, value: NodeValue):
     if value.type == BOOLEAN_T:
         return bool(value.val_bool)
     elif value.type == NUMBER:
         return value.val_num
     elif value.type == STRING:
-        s = value.val_string.decode("utf-8")
-        _lib.Node_Dispose_Value(value)
-        return s
+        return _key(node, value)
+    elif value.type == STRING_ONE_BYTE:
+        return ctypes.string_at(value.val_ptr, value.length).decode("latin-1")
+    elif value.type == STRING_TWO_BYTE:
+        data = ctypes.string_at(value.val_ptr, value.length * 2)
+        return data.decode("utf-16-le", "replace")
     elif value.type == FUNCTION:
-        return Func(value.val_string.decode("utf-8"), node, value)
+        name = _lib.NodeContext_Handle_Name(node._context, value) or b""
+        return Func(name.decode("utf-8"), node, _copy(value))
     elif value.type == SET:
-        arr = NativeSet(value)
-        L = value.val_array_len
-        for i in range(L):
-            arr.add(_to_python(node, value.val_array[i]))
-        return arr
+        return NativeSet(
+            None, (_from_node(node, value.val_children[i]) for i in range(value.length))
+        )
     elif value.type == ARRAY:
-        arr = NativeArray(value)
-        L = value.val_array_len
-        for i in range(L):
-            arr.append(_to_python(node, value.val_array[i]))
-        return arr
+        return NativeArray(
+            None, [_to_python(node, value.val_children[i]) for i in range(value.length)]
+        )
     elif value.type == TYPED_ARRAY:
-        kind = "b"
-        c_kind = ctypes.c_int8
-        if value.val_tarray_type == UINT8_T:
-            kind = "B"
-            c_kind = ctypes.c_uint8
-        elif value.val_tarray_type == INT16_T:
-            kind = "h"
-            c_kind = ctypes.c_int16
-        elif value.val_tarray_type == UINT16_T:
-            kind = "H"
-            c_kind = ctypes.c_uint16
-        elif value.val_tarray_type == INT32_T:
-            kind = "i"
-            c_kind = ctypes.c_int32
-        elif value.val_tarray_type == UINT32_T:
-            kind = "I"
-            c_kind = ctypes.c_uint32
-        elif value.val_tarray_type == BINT64_T:
-            kind = "l"
-            c_kind = ctypes.c_int64
-        elif value.val_tarray_type == BUINT64_T:
-            kind = "L"
-            c_kind = ctypes.c_uint64
-        elif value.val_tarray_type == FLOAT32_T:
-            kind = "f"
-            c_kind = ctypes.c_float
-        elif value.val_tarray_type == FLOAT64_T:
-            kind = "d"
-            c_kind = ctypes.c_double
-        ptr = ctypes.cast(value.val_tarray, ctypes.POINTER(c_kind))
-        elements = []
-        for i in range(value.val_array_len):
-            elements.append(ptr[i])
-        return array.array(kind, elements)
+        return _buffer(node, value, _TYPED_ARRAY_CODES.get(value.subtype, "b"))
+    elif value.type == ARRAY_BUFFER:
+        return _buffer(node, value, "B")
+    elif value.type == SHARED_ARRAY_BUFFER:
+        return SharedArrayBuffer(_buffer(node, value, "B"))
+    elif value.type == JSON_T:
+        return json.loads(ctypes.string_at(value.val_ptr, value.length))
+    elif value.type == SERIALIZED:
+        return Serialized(ctypes.string_at(value.val_ptr, value.length))
     elif value.type == BIGINT:
-        i = int(value.val_big.decode("utf-8"))
-        _lib.Node_Dispose_Value(value)
-        return i
+        return _bigint(value)
     elif value.type == OBJECT:
-        obj = NativeObject(value)
-        L = value.object_len
-        for i in range(L):
-            obj[value.object_keys[i].decode("utf-8")] = _to_python(
-                node, value.object_values[i]
-            )
+        obj = NativeObject(None)
+        children = value.val_children
+        for i in range(value.length):
+            obj[_key(node, children[i * 2])] = _to_python(node, children[i * 2 + 1])
         return obj
     elif value.type == MAP:
-        obj = NativeObject(value)
-        L = value.object_len
-        for i in range(L):
-            obj[_to_python(node, value.object_keys[i])] = _to_python(
-                node, value.object_values[i]
+        obj = NativeObject(None)
+        children = value.val_children
+        for i in range(value.length):
+            obj[_from_node(node, children[i * 2])] = _from_node(
+                node, children[i * 2 + 1]
             )
         return obj
     elif value.type == DATE_T:
-        return NativeDatetime(node, value.val_date_unix)
+        return NativeDatetime.fromtimestamp(value.val_num / 1000)
     elif value.type == EXTERNAL:
-        return NativeSymbol(value.val_external_ptr)
+        return JSExternal(value.val_ptr)
     elif value.type == SYMBOL:
-        if value.val_string != 0:
-            return JSSymbol(value.val_external_ptr, value.val_string.decode("utf-8"))
-        return JSSymbol(value.val_external_ptr)
+        description = _lib.NodeContext_Handle_Name(node._context, value)
+        return JSSymbol(
+            _copy(value), description.decode("utf-8") if description else None, node
+        )
     elif value.type == REGEXP:
         flags = 0
-        if value.val_regex_flags & (1 << 1):  # kIgnoreCase
+        if value.subtype & (1 << 1):  # kIgnoreCase
             flags |= re.IGNORECASE
-        if value.val_regex_flags & (1 << 2):  # kMultiline
+        if value.subtype & (1 << 2):  # kMultiline
             flags |= re.MULTILINE
-        if value.val_regex_flags & (1 << 4):  # kUnicode (has no effect in Python 3)
+        if value.subtype & (1 << 4):  # kUnicode (has no effect in Python 3)
             flags |= re.UNICODE
-        if value.val_regex_flags & (1 << 5):  # kDotAll
+        if value.subtype & (1 << 5):  # kDotAll
             flags |= re.DOTALL
-        return NativePattern(node, re.compile(value.val_string, flags))
+        return NativePattern(None, re.compile(_string(value), flags))
     elif value.type == PROXY:
         return JSProxy(
-            node,
-            _to_python(node, value.val_proxy_target),
-            _to_python(node, value.val_proxy_handler),
+            None,
+            _from_node(node, value.val_children[0]),
+            _from_node(node, value.val_children[1]),
         )
+    elif value.type == ERROR_T:
+        return JSError(*(_string(value.val_children[i]) for i in range(3)))
+    elif value.type == LAZY_OBJECT:
+        return LazyObject(node, _copy(value))
+    elif value.type == LAZY_ARRAY:
+        return LazyArray(node, _copy(value))
     elif value.type == PROMISE:
-        promise = JSPromise()
-        node._promises[value.future_id] = promise
-        return promise
+        return node._claim_promise(value.val_int)
     return None
 
 
+def _from_node(node, value: NodeValue):
+    if _binding is None:
+        return _to_python(node, value)
+    return _binding.to_python(node, ctypes.addressof(value))
+
+
+def _to_nodes(node, values):
+    """
+    Converts values to a NodeValue array, which owns everything it points to.
+    """
+    values = list(values)
+    converted = _binding.to_node(node, values)
+    return (NodeValue * len(values)).from_buffer(converted)
+
+
+if _binding is not None:
+    _binding.setup(
+        NativeArray,
+        NativeObject,
+        lambda node, address: _to_python(node, NodeValue.from_address(address)),
+        _to_node,
+    )
+
+
+def _percentile(buckets, count, q) -> int:
+    # Upper bound of the log2 bucket holding the q-th duration.
+    rank = q * count
+    seen = 0
+    for i, n in enumerate(buckets):
+        seen += n
+        if seen >= rank:
+            return 2 ** (i + 1)
+    return 2 ** len(buckets)
+
+
+def _consume(node, result, timing=None):
+    """
+    Converts a result returned by the library and releases its arena. The
+    conversion is timed as the PHASE_PYTHON of `timing`, a (kind, site) pair,
+    when the node records timings.
+    """
+    try:
+        if timing is None or not node._timing:
+            return _from_node(node, result.contents.value)
+        start = time.perf_counter_ns()
+        try:
+            return _from_node(node, result.contents.value)
+        finally:
+            node._record_timing(*timing, time.perf_counter_ns() - start)
+    finally:
+        _lib.Node_Release_Result(result)
+        node._after_call()
+
+
 class CoroutineTracker:
     def __init__(self, listener):
         self._listener = listener
@@ -674,60 +1330,171 @@ class CoroutineTracker:
             )
 
 
+# Guards JSPromise state, promises are settled from the JS thread when the
+# context runs on its own thread, and awaited from whichever loop awaits them.
+_promise_lock = threading.Lock()
+_PENDING, _FULFILLED, _REJECTED = range(3)
+
+
+def _running_loop():
+    try:
+        return asyncio.get_running_loop()
+    except RuntimeError:
+        return None
+
+
+def _wake(waiters):
+    for waiter in waiters:
+        if not waiter.done():
+            waiter.set_result(None)
+
+
+def _settle_promises(settled):
+    """
+    Settles (promise, rejected, value) items, waking each asyncio loop
+    awaiting some of them once for the whole batch.
+    """
+    woken = {}
+    with _promise_lock:
+        for promise, rejected, value in settled:
+            if promise._state is not _PENDING:
+                continue
+            if rejected:
+                if not isinstance(value, BaseException):
+                    value = JSError(str(value))
+                promise._state = _REJECTED
+            else:
+                promise._state = _FULFILLED
+            promise._value = value
+            for waiter in promise._waiters:
+                woken.setdefault(waiter.get_loop(), []).append(waiter)
+            promise._waiters = None
+    current = _running_loop()
+    for loop, waiters in woken.items():
+        if loop is current:
+            _wake(waiters)
+        else:
+            loop.call_soon_threadsafe(_wake, waiters)
+
+
 class JSPromise:
+    __slots__ = ("_state", "_value", "_waiters")
+
     def __init__(self):
-        self._loop = asyncio.get_event_loop()
-        self._future = self._loop.create_future()
+        self._state = _PENDING
+        self._value = None
         self._waiters = []
 
     def __await__(self):
-        async def waiter():
-            result = await self._future
-            return result
-
-        return waiter().__await__()
+        with _promise_lock:
+            waiter = None
+            if self._state is _PENDING:
+                waiter = asyncio.get_running_loop().create_future()
+                self._waiters.append(waiter)
+        if waiter is not None:
+            yield from waiter
+        if self._state is _REJECTED:
+            raise self._value
+        return self._value
+
+    def done(self) -> bool:
+        return self._state is not _PENDING
 
     def resolve(self, value):
-        if not self._future.done():
-            self._future.set_result(value)
+        _settle_promises([(self, False, value)])
+
+    def reject(self, error):
+        _settle_promises([(self, True, error)])
 
 
 class Node:
-    def __init__(self, path=__file__, thread_pool_size=1):
+    def __init__(
+        self,
+        path=__file__,
+        thread_pool_size=None,
+        lazy=False,
+        code_cache=os.environ.get("PYTHONODEJS_CODE_CACHE"),
+        code_cache_size=256 * 1024 * 1024,
+        snapshot=os.environ.get("PYTHONODEJS_SNAPSHOT"),
+    ):
+        """
+        Args:
+            thread_pool_size: Number of V8 platform workers. They are shared by
+                every context, so this only applies before the first one is
+                created, see configure.
+            code_cache: Directory where V8 code cache of evaluated scripts is
+                kept across runs, disabled when None. Defaults to the
+                PYTHONODEJS_CODE_CACHE environment variable.
+            code_cache_size: Size in bytes past which least recently used
+                cache entries are evicted.
+            snapshot: Startup snapshot made by build_snapshot to start from.
+                Defaults to the PYTHONODEJS_SNAPSHOT environment variable.
+        """
         self.cleaned = False
         self._context = _lib.NodeContext_Create()
+        _context_opened(1)
         self._python_funcs = {}
         self._registered_functions = {}
         self._promises = {}
+        # Settlements of JS promises whose result Python had not converted
+        # yet, by id. Both maps are guarded by _promises_lock.
+        self._early_settlements = {}
+        self._promises_lock = threading.Lock()
+        self._future_ids = []  # released ids of Python futures passed to JS
+        self._next_future_id = itertools.count()
+        self._borrowed = {}
+        self._dead_handles = []  # released from __del__, freed in batches
+        self._timing = False
+        self._keys = {}
+        self._key_ids = {}
+        self._loop = None
+        self._loop_fd = -1
+        self._loop_timer = None
+        self._thread = False
+        self._pending = {}
+        self._command_ids = itertools.count()
 
         argc = 1
         argv = (ctypes.c_char_p * argc)(path.encode("utf-8"))
 
         def _trackcb(action, *args):
-            if action == "complete":
+            if action in ("complete", "error"):
                 _lib.NodeContext_FutureUpdate(
-                    self._context, args[0], _to_node(self, args[1]), False
-                )
-            elif action == "error":
-                _lib.NodeContext_FutureUpdate(
-                    self._context, args[0], _to_node(self, args[1]), True
+                    self._context,
+                    args[0],
+                    ctypes.byref(_to_node(self, args[1])),
+                    action == "error",
                 )
+                self._future_ids.append(args[0])
+                self._after_call()
 
         self._tracker = CoroutineTracker(_trackcb)
 
         def _callback(function_name, values_ptr, length):
+            site = function_name
             function_name = re.sub(
                 r"([a-zA-Z_\$][\w\$]*)\s*\(\s*\)\s*;*",
                 r"\1",
                 function_name.decode("utf-8").strip(),
             )
             if function_name in self._python_funcs:
+                timed = self._timing
+                start = time.perf_counter_ns() if timed else 0
                 args = [None] * length
                 for i in range(length):
-                    args[i] = _to_python(self, values_ptr[i])
+                    args[i] = _from_node(self, values_ptr[i])
+                converted = time.perf_counter_ns() if timed else 0
                 res = self._python_funcs[function_name](*args)
-                if res:
-                    return _to_node(self, res)
+                returned = time.perf_counter_ns() if timed else 0
+                if res is not None:
+                    # Kept alive until the next callback, the library converts
+                    # it as soon as this function returns.
+                    self._callback_result = _to_node(self, res)
+                if timed:
+                    elapsed = converted - start + time.perf_counter_ns() - returned
+                    self._record_timing(TIMING_CALLBACK, site, elapsed)
+                if res is not None:
+                    return ctypes.addressof(self._callback_result)
                 return 0
             else:
                 raise Exception(f"Function not found. {function_name}")
@@ -736,24 +1503,448 @@ class Node:
 
         _lib.NodeContext_SetCallback(self._context, self._callback)
 
-        def _future_callback(i, result, reject):
-            if i in self._promises:
-                self._promises[i].resolve(result)
+        def _future_callback(result):
+            start = time.perf_counter_ns() if self._timing else 0
+            try:
+                items = result.contents.value.val_children
+                settled = []
+                for i in range(0, result.contents.value.length, 2):
+                    id = items[i].val_int
+                    value = _from_node(self, items[i + 1])
+                    with self._promises_lock:
+                        promise = self._promises.pop(id, None)
+                        if promise is None:
+                            self._early_settlements[id] = (items[i].subtype, value)
+                    if promise is not None:
+                        settled.append((promise, items[i].subtype, value))
+                        self._release_future(id)
+            finally:
+                _lib.Node_Release_Result(result)
+            if start:
+                elapsed = time.perf_counter_ns() - start
+                self._record_timing(TIMING_SETTLE, "", elapsed)
+            _settle_promises(settled)
 
         self._future_callback = FUTURE_CALLBACK(_future_callback)
 
         _lib.NodeContext_SetFutureCallback(self._context, self._future_callback)
 
+        def _completion_callback(i, result):
+            future, _, timing = self._pending.pop(i)
+            try:
+                value = _consume(self, result, timing)
+            except BaseException as e:
+                future.set_exception(e)
+            else:
+                future.set_result(value)
+
+        self._completion_callback = COMPLETION_CALLBACK(_completion_callback)
+
+        _lib.NodeContext_SetCompletionCallback(self._context, self._completion_callback)
+
+        if thread_pool_size is not None:
+            configure(platform_workers=thread_pool_size)
         error = _lib.NodeContext_Setup(self._context, 1, argv)
         if not error == 0:
             raise Exception("Failed to setup node.")
+        if snapshot:
+            _lib.NodeContext_SetSnapshot(self._context, os.fsencode(snapshot))
         ImportsArrayType = ctypes.c_char_p * 0
         c_array = ctypes.cast(ImportsArrayType(*[]), ctypes.POINTER(ctypes.c_char_p))
 
-        error = _lib.NodeContext_Init(self._context, c_array, 0, thread_pool_size)
+        error = _lib.NodeContext_Init(self._context, c_array, 0, 0)
         if not error == 0:
             raise Exception("Failed to init node.")
 
+        self.lazy = lazy
+        if code_cache:
+            _lib.NodeContext_SetCodeCache(
+                self._context, os.fsencode(code_cache), code_cache_size
+            )
+
+    @property
+    def lazy(self) -> bool:
+        """
+        When enabled, JS objects and arrays are returned as LazyObject and
+        LazyArray handles instead of being converted eagerly.
+        """
+        return self._lazy
+
+    @lazy.setter
+    def lazy(self, value: bool):
+        self._lazy = bool(value)
+        _lib.NodeContext_SetLazy(self._context, self._lazy)
+
+    def attach(self, loop: asyncio.AbstractEventLoop = None):
+        """
+        Runs the JS event loop from an asyncio loop. Calls then return as soon
+        as their result is ready instead of waiting for the JS event loop to
+        drain, and servers, timers and sockets keep running alongside Python
+        coroutines. Promise results arrive through the asyncio loop.
+        """
+        if self._loop is not None:
+            self.detach()
+        self._loop = loop or asyncio.get_event_loop()
+        _lib.NodeContext_SetNonBlocking(self._context, True)
+        self._loop_fd = _lib.NodeContext_Backend_Fd(self._context)
+        if self._loop_fd >= 0:
+            self._loop.add_reader(self._loop_fd, self._tick)
+        self._schedule_tick()
+
+    def detach(self):
+        """
+        Stops driving the JS event loop from asyncio, calls drain it again.
+        """
+        if self._loop is None:
+            return
+        if self._loop_fd >= 0:
+            self._loop.remove_reader(self._loop_fd)
+        if self._loop_timer is not None:
+            self._loop_timer.cancel()
+            self._loop_timer = None
+        self._loop = None
+        _lib.NodeContext_SetNonBlocking(self._context, False)
+
+    def start_thread(self):
+        """
+        Moves JS execution to a thread owned by this context. Calls from any
+        Python thread are queued to it without contending for the isolate,
+        and JS keeps running while Python does other work. eval, define and
+        function calls wait for their result, submit* return futures and
+        eval_async an awaitable.
+        """
+        if self._loop is not None:
+            raise RuntimeError("Detach from asyncio before starting a thread")
+        if _lib.NodeContext_Start_Thread(self._context) != 0:
+            raise Exception("Failed to start the JS thread.")
+        self._thread = True
+
+    def stop_thread(self):
+        if not self._thread:
+            return
+        self._thread = False
+        _lib.NodeContext_Stop_Thread(self._context)
+
+    def _threaded(self) -> bool:
+        # JS calling back into Python runs on the JS thread, which can not
+        # wait for itself.
+        return self._thread and not _lib.NodeContext_On_Thread(self._context)
+
+    def _post(self, post, *args, keep=None, timing=None) -> concurrent.futures.Future:
+        if not self._thread:
+            raise RuntimeError("submit needs a JS thread, see start_thread")
+        future = concurrent.futures.Future()
+        i = next(self._command_ids)
+        # Arguments stay alive until the command completes.
+        self._pending[i] = (future, keep, timing)
+        post(self._context, i, *args)
+        return future
+
+    def submit(self, code: str, transfer=None) -> concurrent.futures.Future:
+        return self._post(
+            _lib.NodeContext_Post_Script,
+            code.encode("utf-8"),
+            _TRANSFERS[transfer],
+            timing=(TIMING_SCRIPT, ""),
+        )
+
+    def submit_call(
+        self, func, *args, construct=False, transfer=None
+    ) -> concurrent.futures.Future:
+        n_args = func._args(args, transfer)
+        return self._post(
+            _lib.NodeContext_Post_Call,
+            func._nv,
+            n_args,
+            len(args),
+            construct,
+            _TRANSFERS[transfer],
+            keep=(func, n_args),
+            timing=(TIMING_CONSTRUCT if construct else TIMING_CALL, func.__name__),
+        )
+
+    def submit_map(self, func, rows) -> concurrent.futures.Future:
+        if not isinstance(rows, ctypes.Array):
+            rows = func._rows(rows)
+        return self._post(
+            _lib.NodeContext_Post_Map, func._nv, rows, len(rows), keep=(func, rows)
+        )
+
+    def submit_define(self, vars: dict) -> concurrent.futures.Future:
+        keys = (ctypes.c_char_p * len(vars))()
+        for i, k in enumerate(vars):
+            keys[i] = k.encode("utf-8")
+        vals = _children(self, vars.values())
+        return self._post(
+            _lib.NodeContext_Post_Define, keys, vals, len(vars), keep=(keys, vals)
+        )
+
+    def eval_async(self, code: str) -> asyncio.Future:
+        return asyncio.wrap_future(self.submit(code))
+
+    def _tick(self):
+        _lib.NodeContext_Tick(self._context)
+        self._after_call()
+
+    def _schedule_tick(self):
+        # Calls and ticks can add or remove timers, so the deadline is
+        # recomputed after each of them.
+        if self._loop_timer is not None:
+            self._loop_timer.cancel()
+            self._loop_timer = None
+        timeout = _lib.NodeContext_Backend_Timeout(self._context)
+        if self._loop_fd < 0 and not 0 <= timeout <= 10:
+            timeout = 10  # nothing to wait on, poll
+        if timeout >= 0:
+            self._loop_timer = self._loop.call_later(timeout / 1000, self._tick)
+
+    def _future_id(self) -> int:
+        # Ids index the resolver table of the context, they are kept small.
+        if self._future_ids:
+            return self._future_ids.pop()
+        return next(self._next_future_id)
+
+    def _claim_promise(self, id: int) -> JSPromise:
+        # The promise may have settled before its result got converted.
+        promise = JSPromise()
+        with self._promises_lock:
+            settlement = self._early_settlements.pop(id, None)
+            if settlement is None:
+                self._promises[id] = promise
+        if settlement is not None:
+            self._release_future(id)
+            _settle_promises([(promise, *settlement)])
+        return promise
+
+    def _release_future(self, id: int):
+        # The id may go to a new promise once both sides are done with it.
+        _lib.NodeContext_Release_Futures(self._context, (ctypes.c_int64 * 1)(id), 1)
+
+    def _release_handle(self, ref: int):
+        # Called from __del__ and finalizers, on whichever thread collects.
+        self._dead_handles.append(ref)
+
+    def _release_handles(self):
+        count = len(self._dead_handles)
+        if not count or self.cleaned:
+            return
+        refs = (ctypes.c_uint64 * count)(*self._dead_handles[:count])
+        del self._dead_handles[:count]
+        _lib.NodeContext_Release_Handles(self._context, refs, count)
+
+    def handle_stats(self) -> dict:
+        """
+        Returns the counters of the handles this context holds for Python:
+        live handles, table slots, handles created and released so far,
+        releases waiting for the next call, and stale releases.
+        """
+        self._release_handles()
+        stats = NodeHandleStats()
+        _lib.NodeContext_Handle_Stats(self._context, ctypes.byref(stats))
+        return {name: getattr(stats, name) for name, _ in stats._fields_}
+
+    @property
+    def timing(self) -> bool:
+        """
+        When enabled, the phases of calls, scripts, callbacks and promise
+        settlements are timed into per-function histograms, see
+        timing_stats. Off by default, it then costs nothing measurable.
+        """
+        return self._timing
+
+    @timing.setter
+    def timing(self, value: bool):
+        self._timing = bool(value)
+        _lib.NodeContext_Timing_Enable(self._context, self._timing)
+
+    def _record_timing(self, kind: int, site, ns: int):
+        if isinstance(site, str):
+            site = site.encode("utf-8")
+        _lib.NodeContext_Timing_Record(self._context, kind, site, PHASE_PYTHON, ns)
+
+    def timing_stats(self) -> dict:
+        """
+        Returns the timed phases as {kind: {site: {phase: stats}}}. Kinds are
+        script, call, construct, callback, settle and resolve, sites are
+        function names. Phases are args (conversion to JS), run, loop (event
+        loop drain after the call), result (conversion from JS) and python
+        (conversion of Python objects). Each has count, total_ns, max_ns,
+        p50_ns and p99_ns (upper bounds of the matching histogram bucket),
+        and buckets, where bucket i counts durations of [2^i, 2^(i+1)) ns.
+        """
+        count = _lib.NodeContext_Timing_Read(self._context, None, 0)
+        histograms = (NodeTimingHistogram * count)()
+        count = min(
+            count, _lib.NodeContext_Timing_Read(self._context, histograms, count)
+        )
+        stats = {}
+        for histogram in histograms[:count]:
+            buckets = list(histogram.buckets)
+            sites = stats.setdefault(_TIMING_KINDS[histogram.kind], {})
+            phases = sites.setdefault(histogram.site.decode("utf-8", "replace"), {})
+            phases[_TIMING_PHASES[histogram.phase]] = {
+                "count": histogram.count,
+                "total_ns": histogram.total_ns,
+                "max_ns": histogram.max_ns,
+                "p50_ns": _percentile(buckets, histogram.count, 0.5),
+                "p99_ns": _percentile(buckets, histogram.count, 0.99),
+                "buckets": buckets,
+            }
+        return stats
+
+    def reset_timing(self):
+        _lib.NodeContext_Timing_Reset(self._context)
+
+    def memory_stats(self) -> dict:
+        """
+        Returns the V8 heap statistics of this context, with per space figures
+        under "heap_spaces", and what the bridge holds: live handles, promises
+        pending in either direction, and the results and arena bytes not
+        released yet in the process. Cheap enough to be exported as gauges.
+        """
+        stats = NodeMemoryStats()
+        _lib.NodeContext_Memory_Stats(self._context, ctypes.byref(stats))
+        result = {name: getattr(stats, name) for name, _ in stats._fields_}
+        spaces = (NodeHeapSpaceStats * 16)()
+        count = _lib.NodeContext_Heap_Space_Stats(self._context, spaces, 16)
+        result["heap_spaces"] = {
+            space.name.decode(): {
+                name: getattr(space, name) for name, _ in space._fields_[1:]
+            }
+            for space in spaces[: min(count, 16)]
+        }
+        return result
+
+    def start_profiling(self, sampling_interval_us: int = 1000):
+        """
+        Starts recording a V8 CPU profile of the JS run by this context,
+        sampled every `sampling_interval_us` microseconds. With a JS thread,
+        the profile is started there, while it keeps running.
+        """
+        if self._threaded():
+            started = self._post(
+                _lib.NodeContext_Post_Profile_Start, sampling_interval_us
+            ).result()
+        else:
+            started = (
+                _lib.NodeContext_Profile_Start(self._context, sampling_interval_us) == 0
+            )
+        if not started:
+            raise RuntimeError("Failed to start the CPU profiler.")
+
+    def stop_profiling(self, path: Union[str, Path], collapsed=None):
+        """
+        Stops the profile started by start_profiling and writes it to `path`
+        as a .cpuprofile (Chrome DevTools, speedscope) and, if `collapsed` is
+        given, as collapsed stacks to that path (flamegraph.pl, inferno).
+        """
+        path = os.fsencode(path)
+        collapsed = os.fsencode(collapsed) if collapsed is not None else None
+        if self._threaded():
+            written = self._post(
+                _lib.NodeContext_Post_Profile_Stop,
+                path,
+                collapsed,
+                keep=(path, collapsed),
+            ).result()
+        else:
+            written = _lib.NodeContext_Profile_Stop(self._context, path, collapsed) == 0
+        if not written:
+            raise RuntimeError("Failed to write the CPU profile.")
+
+    @contextlib.contextmanager
+    def profile(self, path: Union[str, Path], collapsed=None, **kwargs):
+        """
+        Profiles the JS run inside the with block, see start_profiling.
+        """
+        self.start_profiling(**kwargs)
+        try:
+            yield
+        finally:
+            self.stop_profiling(path, collapsed)
+
+    def heap_snapshot(self, path: Union[str, Path]):
+        """
+        Writes a .heapsnapshot of this context for Chrome DevTools. JS values
+        held from Python are retained by a "pythonodejs handles" root, named
+        after the function or symbol they hold. Pending handle releases are
+        flushed first so that they do not show up as retainers.
+        """
+        self._release_handles()
+        if _lib.NodeContext_Heap_Snapshot(self._context, os.fsencode(path)) != 0:
+            raise RuntimeError("Failed to write the heap snapshot.")
+
+    def start_heap_sampling(self, sampling_interval: int = 0, stack_depth: int = 0):
+        """
+        Starts sampling JS allocations, on average one every
+        `sampling_interval` bytes (V8's 512K by default).
+        """
+        error = _lib.NodeContext_Heap_Sampling_Start(
+            self._context, sampling_interval, stack_depth
+        )
+        if error != 0:
+            raise RuntimeError("Failed to start sampling the heap.")
+
+    def stop_heap_sampling(self, path: Union[str, Path]):
+        """
+        Writes the sampled allocations still alive, by allocation site, to
+        `path` as a .heapprofile (Chrome DevTools, speedscope).
+        """
+        if _lib.NodeContext_Heap_Sampling_Stop(self._context, os.fsencode(path)):
+            raise RuntimeError("Failed to write the heap profile.")
+
+    @contextlib.contextmanager
+    def sample_heap(self, path: Union[str, Path], **kwargs):
+        """
+        Samples the allocations made inside the with block, see
+        start_heap_sampling.
+        """
+        self.start_heap_sampling(**kwargs)
+        try:
+            yield
+        finally:
+            self.stop_heap_sampling(path)
+
+    def _after_call(self):
+        self._release_handles()
+        self._release_buffers()
+        if self._loop is not None:
+            self._schedule_tick()
+
+    def _borrow(self, view: memoryview):
+        """
+        Lends the memory of a buffer to JS without copying it. The buffer is
+        held (and cannot be resized) until V8 releases its ArrayBuffer.
+        Read-only buffers such as bytes are copied, JS could write to them.
+        """
+        if not view.nbytes:
+            return None
+        if view.readonly or not view.c_contiguous:
+            view = memoryview(bytearray(view.tobytes()))
+        buf = _PyBuffer()
+        _PyObject_GetBuffer(view, ctypes.byref(buf), 0)  # PyBUF_SIMPLE
+        self._borrowed.setdefault(buf.buf, []).append(buf)
+        return buf.buf
+
+    def _release_buffers(self):
+        if not self._borrowed:
+            return
+        released = (ctypes.c_void_p * 64)()
+        while True:
+            count = _lib.NodeContext_Drain_Released(self._context, released, 64)
+            for i in range(count):
+                held = self._borrowed.get(released[i])
+                if not held:
+                    continue
+                # Buffers, or str objects lent by the extension.
+                lent = held.pop()
+                if isinstance(lent, _PyBuffer):
+                    _PyBuffer_Release(ctypes.byref(lent))
+                if not held:
+                    del self._borrowed[released[i]]
+            if count < 64:
+                break
+
     def _create_function(self, func):
         if func in self._registered_functions or func.__name__ in self._python_funcs:
             self._python_funcs[func.__name__] = func
@@ -777,31 +1968,43 @@ class Node:
         return mod
 
     def define(self, vars: Union[dict, str], value: Any = None) -> None:
-        if isinstance(vars, dict):
+        if isinstance(vars, dict) and self._threaded():
+            self.submit_define(vars).result()
+        elif isinstance(vars, dict):
             keys = (ctypes.c_char_p * len(vars))()
-            vals = (NodeValue * len(vars))()
             for i, k in enumerate(vars):
                 keys[i] = k.encode("utf-8")
-                vals[i] = _to_node(self, vars[k])
+            vals = _children(self, vars.values())
             _lib.NodeContext_Define_Global(self._context, keys, vals, len(vars))
         else:
             self.define({vars: value})
 
-    def eval(self, code: str):
-        return _to_python(
+    def eval(self, code: str, transfer=None):
+        """
+        Args:
+            transfer: "json" or "clone" to return the result as a single
+                buffer, see Func.__call__.
+        """
+        if self._threaded():
+            return self.submit(code, transfer).result()
+        return _consume(
             self,
-            _lib.NodeContext_Run_Script(
+            _lib.NodeContext_Run_Script_As(
                 self._context,
                 code.encode("utf-8"),
+                _TRANSFERS[transfer],
             ),
+            (TIMING_SCRIPT, ""),
         )
 
     def run(self, fp: Union[str, Path]):
         if isinstance(fp, str):
             fp = Path(fp)
-        return eval(Path(fp).read_text("utf-8"))
+        return self.eval(Path(fp).read_text("utf-8"))
 
     def stop(self):
+        self.stop_thread()
+        self.detach()
         _lib.NodeContext_Stop(self._context)
 
     def dispose(self):
@@ -810,19 +2013,227 @@ class Node:
         self.cleaned = True
         self.stop()
         _lib.NodeContext_Dispose(self._context)
+        _context_opened(-1)
+
+
+class NodePool:
+    """
+    Independent Node contexts, each with its own isolate, event loop and
+    thread, to run JS on several cores at once. Work goes to the context with
+    the fewest pending commands. Calls sharing a key always go to the same
+    context, picked from the hash of the key, for code that keeps state
+    between calls.
+
+    Functions are called by global name since a JS function only exists in
+    the context that created it: load them on every context with `setup` or
+    broadcast().
+    """
+
+    def __init__(self, size: int = None, setup: str = None, **node_args):
+        size = size or os.cpu_count() or 1
+        self.nodes = []
+        self._load = [0] * size
+        self._functions = [{} for _ in range(size)]
+        self._lock = threading.Lock()
+        try:
+            for _ in range(size):
+                node = Node(**node_args)
+                self.nodes.append(node)
+                if setup:
+                    node.eval(setup)
+                node.start_thread()
+        except BaseException:
+            # The contexts started so far would outlive the failed pool.
+            self.dispose()
+            raise
+
+    def _acquire(self, key=None) -> int:
+        with self._lock:
+            if key is None:
+                i = min(range(len(self.nodes)), key=self._load.__getitem__)
+            else:
+                i = hash(key) % len(self.nodes)
+            self._load[i] += 1
+        return i
+
+    def _release(self, i: int, future):
+        with self._lock:
+            self._load[i] -= 1
+
+    def _track(self, i: int, future) -> concurrent.futures.Future:
+        future.add_done_callback(lambda f: self._release(i, f))
+        return future
 
+    def submit(self, code: str, key=None) -> concurrent.futures.Future:
+        i = self._acquire(key)
+        return self._track(i, self.nodes[i].submit(code))
 
-_context = Node()
+    def submit_call(self, name: str, *args, key=None) -> concurrent.futures.Future:
+        i = self._acquire(key)
+        try:
+            with self._lock:
+                func = self._functions[i].get(name)
+            if func is None:
+                func = self.nodes[i].eval(name)
+                with self._lock:
+                    func = self._functions[i].setdefault(name, func)
+            future = self.nodes[i].submit_call(func, *args)
+        except BaseException:
+            self._release(i, None)
+            raise
+        return self._track(i, future)
+
+    def eval(self, code: str, key=None):
+        return self.submit(code, key).result()
+
+    def call(self, name: str, *args, key=None):
+        return self.submit_call(name, *args, key=key).result()
+
+    def eval_async(self, code: str, key=None) -> asyncio.Future:
+        return asyncio.wrap_future(self.submit(code, key))
+
+    def call_async(self, name: str, *args, key=None) -> asyncio.Future:
+        return asyncio.wrap_future(self.submit_call(name, *args, key=key))
+
+    def broadcast(self, code: str) -> list:
+        """
+        Evaluates code on every context, e.g. to define functions.
+        """
+        futures = [node.submit(code) for node in self.nodes]
+        return [future.result() for future in futures]
+
+    def dispose(self):
+        self._functions = [{} for _ in self.nodes]
+        for node in self.nodes:
+            node.dispose()
+        self.nodes = []
+
+
+def configure(
+    platform_workers: int = None, uv_threadpool_size: int = None, cpus=None
+) -> bool:
+    """
+    Sets up the threads shared by every context of the process. Only applies
+    before the first context is created, returns False afterwards.
+
+    Args:
+        platform_workers (int): V8 worker threads running GC and compilation
+            tasks, 4 by default.
+        uv_threadpool_size (int): Size of the libuv threadpool used by fs,
+            crypto, dns and zlib, UV_THREADPOOL_SIZE or 4 by default.
+        cpus: CPUs to pin those threads to, Linux only.
+    """
+    cpus = list(cpus or ())
+    return (
+        _lib.Node_Configure(
+            platform_workers or 0,
+            uv_threadpool_size or 0,
+            (ctypes.c_int * len(cpus))(*cpus),
+            len(cpus),
+        )
+        == 0
+    )
+
+
+def platform_stats() -> dict:
+    """
+    Returns the counters of the worker threads: V8 tasks queued, running and
+    completed, V8 jobs running, and uv_probe_wait_ns, how long work currently
+    waits for a free libuv threadpool thread. Sampled on each call, a high
+    wait means the threadpool is saturated.
+    """
+    stats = NodePlatformStats()
+    _lib.Node_Platform_Stats(ctypes.byref(stats))
+    return {name: getattr(stats, name) for name, _ in stats._fields_}
+
+
+_context = None
+
+# Contexts not disposed yet, Node_Shutdown may only run once none is left.
+_open_contexts = 0
+_open_contexts_lock = threading.Lock()
+
+
+def _context_opened(delta: int):
+    global _open_contexts
+    with _open_contexts_lock:
+        _open_contexts += delta
+
+
+@atexit.register
+def _shutdown():
+    """
+    Tears down Node and V8 for the process at exit, after disposing the
+    default context. Skipped while other contexts are still open.
+    """
+    if _context is not None:
+        _context.dispose()
+    if _open_contexts == 0:
+        _lib.Node_Shutdown()
+
+
+def _node() -> Node:
+    """
+    Returns the default node context, created on first use so that importing
+    the module stays cheap.
+    """
+    global _context
+    if _context is None:
+        _context = Node()
+    return _context
+
+
+def _build_snapshot(path: str, modules: list, warmup: str) -> int:
+    context = _lib.NodeContext_Create()
+    argv = (ctypes.c_char_p * 1)(__file__.encode("utf-8"))
+    if _lib.NodeContext_Setup(context, 1, argv) != 0:
+        return 1
+    names = (ctypes.c_char_p * len(modules))(*[m.encode("utf-8") for m in modules])
+    return _lib.NodeContext_Build_Snapshot(
+        context, os.fsencode(path), names, len(modules), warmup.encode("utf-8")
+    )
+
+
+def build_snapshot(path: Union[str, Path], modules=(), warmup: str = "") -> None:
+    """
+    Builds a startup snapshot with the given modules already required and the
+    warmup script already run. Contexts created with Node(snapshot=path), or
+    with PYTHONODEJS_SNAPSHOT set, start from it instead of bootstrapping.
+
+    The snapshot is built in a separate process, V8 can only be set up once
+    per process and a snapshotting context can not be used afterwards. It is
+    only valid for the Node version it was built with.
+
+    Args:
+        path (Union[str, Path]): Where to write the snapshot.
+        modules: Module names to require, resolved from the current directory.
+        warmup (str): JavaScript run after the modules are loaded.
+    """
+    package_dir = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+    env = dict(os.environ)
+    env["PYTHONPATH"] = os.pathsep.join(
+        p for p in (package_dir, env.get("PYTHONPATH")) if p
+    )
+    subprocess.run(
+        [
+            sys.executable,
+            "-c",
+            "import sys, json; from pythonodejs.main import _build_snapshot; "
+            "sys.exit(_build_snapshot(*json.loads(sys.argv[1])))",
+            json.dumps([os.fspath(path), list(modules), warmup]),
+        ],
+        env=env,
+        check=True,
+    )
 
 
 def NodeRegister(func):
     """
     Registers a function in the node context with the same name.
     """
-    global _context
     if not isinstance(func, types.FunctionType):
         raise TypeError("Cannot register non-function")
-    _context._create_function(func)
+    _node()._create_function(func)
     return func
 
 
@@ -837,8 +2248,7 @@ def require(module: str):
     Returns:
         The module object from the node context.
     """
-    global _context
-    _context.require(module)
+    return _node().require(module)
 
 
 def define(vars: Union[dict, str], value: Any = None) -> None:
@@ -858,8 +2268,7 @@ def define(vars: Union[dict, str], value: Any = None) -> None:
     Returns:
         None
     """
-    global _context
-    _context.define(vars, value)
+    _node().define(vars, value)
 
 
 def node_eval(code: str):
@@ -876,8 +2285,7 @@ def node_eval(code: str):
         Any: The result of the evaluated code, converted to a Python equivalent.
     """
 
-    global _context
-    return _context.eval(code)
+    return _node().eval(code)
 
 
 def js_eval(code: str):
@@ -896,8 +2304,7 @@ def js_eval(code: str):
         Any: The result of the evaluated code, converted to a Python equivalent.
     """
 
-    global _context
-    return _context.eval(code)
+    return _node().eval(code)
 
 
 def node_run(fp: Union[str, Path]):
@@ -912,8 +2319,7 @@ def node_run(fp: Union[str, Path]):
     Returns:
         Any: The result of the evaluated file, converted to a Python equivalent.
     """
-    global _context
-    return _context.run(fp)
+    return _node().run(fp)
 
 
 def node_dispose():
@@ -921,8 +2327,8 @@ def node_dispose():
     Disposes of the node context. This stops the event loop and cleans up
     any remaining resources.
     """
-    global _context
-    _context.dispose()
+    if _context is not None:
+        _context.dispose()
 
 
 def node_stop():
@@ -935,5 +2341,5 @@ def node_stop():
     Returns:
         None
     """
-    global _context
-    _context.stop()
+    if _context is not None:
+        _context.stop()
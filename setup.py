@@ -17,9 +17,12 @@ external_files = [
     if not f.endswith("/")
 ]
 
+# Converts Python objects to and from the NodeValue trees of pythonodejs.h,
+# main.py falls back to ctypes without it.
 ext = Extension(
-    "pythonodejs",
+    "pythonodejs._binding",
     sources=["src/binding.cpp"],
+    include_dirs=["."],
     language="c++",
 )
 
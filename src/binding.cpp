@@ -1,6 +1,454 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
-// Dummy init to make it a valid Python extension
-static PyModuleDef mod = {PyModuleDef_HEAD_INIT, "pythonodejs", NULL, -1, NULL};
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
 
-PyMODINIT_FUNC PyInit_pythonodejs(void) { return PyModule_Create(&mod); }
\ No newline at end of file
+#include "pythonodejs.h"
+
+// Converts between Python objects and NodeValue trees, in place of the
+// per-field ctypes accesses of main.py. Plain data (None, bools, numbers,
+// strings, lists, tuples and dicts with str keys) is converted here, every
+// other value goes through the Python converters given to `setup`.
+
+static PyObject *native_array;
+static PyObject *native_object;
+static PyObject *to_python_fallback; // (node, address) -> object
+static PyObject *to_node_fallback;   // (node, value) -> ctypes NodeValue
+
+// Length from which strings are used in place by V8 instead of copied.
+static constexpr uint32_t kExternalString = 64 * 1024;
+
+// Storage of the NodeValues built by one to_node call. Strings point into
+// the UTF-8 cache of the str objects, which are kept alive with it.
+struct Tree {
+    std::vector<std::unique_ptr<NodeValue[]>> blocks;
+    std::vector<PyObject *> refs;
+
+    ~Tree() {
+        for (PyObject *ref : refs) {
+            Py_DECREF(ref);
+        }
+    }
+
+    NodeValue *values(size_t count) {
+        blocks.emplace_back(new NodeValue[count]());
+        return blocks.back().get();
+    }
+};
+
+// Exports the converted values as a writable buffer, ctypes views them with
+// from_buffer and keeps this object alive for as long as the view.
+struct Values {
+    PyObject_HEAD
+    Tree *tree;
+    NodeValue *root;
+    Py_ssize_t length;
+};
+
+static void Values_dealloc(Values *self) {
+    delete self->tree;
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject *>(self));
+}
+
+static int Values_getbuffer(Values *self, Py_buffer *view, int flags) {
+    static NodeValue empty;
+    void *data = self->length ? self->root : &empty;
+    return PyBuffer_FillInfo(view, reinterpret_cast<PyObject *>(self), data,
+                             self->length * sizeof(NodeValue), 0, flags);
+}
+
+static PyBufferProcs Values_as_buffer = {
+    reinterpret_cast<getbufferproc>(Values_getbuffer),
+    nullptr,
+};
+
+// Filled in by PyInit__binding, the header as the Python headers set it.
+static PyVarObject values_type_head[] = {PyVarObject_HEAD_INIT(nullptr, 0)};
+static PyTypeObject ValuesType = {};
+
+static bool to_node(Tree &tree, PyObject *node, PyObject *key_ids,
+                    PyObject *obj, NodeValue *out);
+
+static bool set_utf8(Tree &tree, PyObject *str, NodeValue *out) {
+    Py_ssize_t size;
+    const char *data = PyUnicode_AsUTF8AndSize(str, &size);
+    if (data == nullptr) {
+        return false;
+    }
+    Py_INCREF(str);
+    tree.refs.push_back(str);
+    out->type = STRING;
+    out->length = static_cast<uint32_t>(size);
+    out->val_string = const_cast<char *>(data);
+    return true;
+}
+
+// Lends the characters of `str` to V8 as an external string, they are
+// held in Node._borrowed until V8 releases them.
+static bool lend_string(PyObject *node, PyObject *str, void *data) {
+    PyObject *borrowed = PyObject_GetAttrString(node, "_borrowed");
+    PyObject *address = PyLong_FromVoidPtr(data);
+    PyObject *held = nullptr;
+    if (borrowed != nullptr && address != nullptr) {
+        PyObject *empty = PyList_New(0);
+        held = empty ? PyObject_CallMethod(borrowed, "setdefault", "OO",
+                                           address, empty)
+                     : nullptr;
+        Py_XDECREF(empty);
+    }
+    bool lent = held != nullptr && PyList_Append(held, str) == 0;
+    Py_XDECREF(held);
+    Py_XDECREF(address);
+    Py_XDECREF(borrowed);
+    return lent;
+}
+
+// Latin-1 and UCS-2 strings are passed in Python's own representation, V8
+// copies them without transcoding, or uses large ones in place.
+static bool set_string(Tree &tree, PyObject *node, PyObject *str,
+                       NodeValue *out) {
+#if PY_VERSION_HEX < 0x030C0000
+    if (PyUnicode_READY(str) < 0) {
+        return false;
+    }
+#endif
+    int kind = PyUnicode_KIND(str);
+    if (kind == PyUnicode_4BYTE_KIND) {
+        return set_utf8(tree, str, out);
+    }
+    out->type =
+        kind == PyUnicode_1BYTE_KIND ? STRING_ONE_BYTE : STRING_TWO_BYTE;
+    out->length = static_cast<uint32_t>(PyUnicode_GET_LENGTH(str));
+    out->val_ptr = PyUnicode_DATA(str);
+    if (out->length >= kExternalString) {
+        if (!lend_string(node, str, out->val_ptr)) {
+            return false;
+        }
+        out->subtype = 1;
+    }
+    Py_INCREF(str);
+    tree.refs.push_back(str);
+    return true;
+}
+
+static bool str_keys(PyObject *dict) {
+    Py_ssize_t pos = 0;
+    PyObject *key, *value;
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        if (!PyUnicode_Check(key)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Keys already interned by the context are sent by id alone.
+static bool set_key(Tree &tree, PyObject *key_ids, PyObject *key,
+                    NodeValue *out) {
+    PyObject *id = PyDict_GetItemWithError(key_ids, key);
+    if (id == nullptr) {
+        return !PyErr_Occurred() && set_utf8(tree, key, out);
+    }
+    out->type = STRING;
+    out->subtype = static_cast<uint16_t>(PyLong_AsLong(id));
+    return true;
+}
+
+static bool to_node(Tree &tree, PyObject *node, PyObject *key_ids,
+                    PyObject *obj, NodeValue *out) {
+    if (obj == Py_None) {
+        out->type = NULL_T;
+    } else if (PyBool_Check(obj)) {
+        out->type = BOOLEAN_T;
+        out->val_bool = obj == Py_True;
+    } else if (PyFloat_CheckExact(obj)) {
+        out->type = NUMBER;
+        out->val_num = PyFloat_AS_DOUBLE(obj);
+    } else if (PyLong_CheckExact(obj)) {
+        // Numbers however large, only JSBigInt goes to JS as a BigInt.
+        double number = PyLong_AsDouble(obj);
+        if (number == -1.0 && PyErr_Occurred()) {
+            return false;
+        }
+        out->type = NUMBER;
+        out->val_num = number;
+    } else if (PyUnicode_CheckExact(obj)) {
+        return set_string(tree, node, obj, out);
+    } else if (PyList_CheckExact(obj) || PyTuple_CheckExact(obj)) {
+        // Self-referencing containers raise RecursionError, as in Python.
+        if (Py_EnterRecursiveCall(" while converting to JS")) {
+            return false;
+        }
+        Py_ssize_t length = PySequence_Fast_GET_SIZE(obj);
+        PyObject **items = PySequence_Fast_ITEMS(obj);
+        NodeValue *children = tree.values(length);
+        out->type = ARRAY;
+        out->length = static_cast<uint32_t>(length);
+        out->val_children = children;
+        bool converted = true;
+        for (Py_ssize_t i = 0; converted && i < length; i++) {
+            converted = to_node(tree, node, key_ids, items[i], &children[i]);
+        }
+        Py_LeaveRecursiveCall();
+        return converted;
+    } else if (PyDict_CheckExact(obj) && str_keys(obj)) {
+        if (Py_EnterRecursiveCall(" while converting to JS")) {
+            return false;
+        }
+        NodeValue *pairs = tree.values(PyDict_GET_SIZE(obj) * 2);
+        out->type = OBJECT;
+        out->length = static_cast<uint32_t>(PyDict_GET_SIZE(obj));
+        out->val_children = pairs;
+        Py_ssize_t pos = 0;
+        PyObject *key, *value;
+        bool converted = true;
+        for (size_t i = 0; converted && PyDict_Next(obj, &pos, &key, &value);
+             i++) {
+            converted =
+                set_key(tree, key_ids, key, &pairs[i * 2]) &&
+                to_node(tree, node, key_ids, value, &pairs[i * 2 + 1]);
+        }
+        Py_LeaveRecursiveCall();
+        return converted;
+    } else {
+        PyObject *value = PyObject_CallFunctionObjArgs(to_node_fallback, node,
+                                                       obj, nullptr);
+        if (value == nullptr) {
+            return false;
+        }
+        // The ctypes value owns what its fields point to, it is kept too.
+        tree.refs.push_back(value);
+        Py_buffer view;
+        if (PyObject_GetBuffer(value, &view, PyBUF_SIMPLE) != 0) {
+            return false;
+        }
+        bool valid = view.len == sizeof(NodeValue);
+        if (valid) {
+            memcpy(out, view.buf, sizeof(NodeValue));
+        }
+        PyBuffer_Release(&view);
+        if (!valid) {
+            PyErr_SetString(PyExc_TypeError, "Expected a NodeValue.");
+            return false;
+        }
+    }
+    return true;
+}
+
+static PyObject *key_to_python(PyObject *keys, PyObject *key_ids,
+                               const NodeValue &value) {
+    if (value.subtype == 0) {
+        return PyUnicode_DecodeUTF8(value.length ? value.val_string : "",
+                                    value.length, nullptr);
+    }
+    PyObject *id = PyLong_FromLong(value.subtype);
+    if (id == nullptr) {
+        return nullptr;
+    }
+    PyObject *key = PyDict_GetItemWithError(keys, id);
+    if (key != nullptr) {
+        Py_INCREF(key);
+    } else if (!PyErr_Occurred()) {
+        key = PyUnicode_DecodeUTF8(value.val_string, value.length, nullptr);
+        if (key != nullptr && (PyDict_SetItem(keys, id, key) != 0 ||
+                               PyDict_SetItem(key_ids, key, id) != 0)) {
+            Py_CLEAR(key);
+        }
+    }
+    Py_DECREF(id);
+    return key;
+}
+
+static PyObject *to_python(PyObject *node, PyObject *keys, PyObject *key_ids,
+                           const NodeValue &value) {
+    switch (value.type) {
+    case UNDEFINED:
+    case NULL_T:
+        Py_RETURN_NONE;
+    case BOOLEAN_T:
+        return PyBool_FromLong(value.val_bool);
+    case NUMBER:
+        return PyFloat_FromDouble(value.val_num);
+    case STRING:
+        return key_to_python(keys, key_ids, value);
+    case STRING_ONE_BYTE:
+        return PyUnicode_DecodeLatin1(static_cast<const char *>(value.val_ptr),
+                                      value.length, nullptr);
+    case STRING_TWO_BYTE: {
+        int byteorder = -1; // little endian
+        return PyUnicode_DecodeUTF16(static_cast<const char *>(value.val_ptr),
+                                     value.length * 2, "replace", &byteorder);
+    }
+    case ARRAY: {
+        if (Py_EnterRecursiveCall(" while converting from JS")) {
+            return nullptr;
+        }
+        PyObject *list = PyObject_CallOneArg(native_array, Py_None);
+        for (uint32_t i = 0; list != nullptr && i < value.length; i++) {
+            PyObject *item =
+                to_python(node, keys, key_ids, value.val_children[i]);
+            if (item == nullptr || PyList_Append(list, item) != 0) {
+                Py_CLEAR(list);
+            }
+            Py_XDECREF(item);
+        }
+        Py_LeaveRecursiveCall();
+        return list;
+    }
+    case OBJECT: {
+        if (Py_EnterRecursiveCall(" while converting from JS")) {
+            return nullptr;
+        }
+        PyObject *dict = PyObject_CallOneArg(native_object, Py_None);
+        for (uint32_t i = 0; dict != nullptr && i < value.length; i++) {
+            PyObject *key =
+                key_to_python(keys, key_ids, value.val_children[i * 2]);
+            PyObject *item =
+                key ? to_python(node, keys, key_ids,
+                                value.val_children[i * 2 + 1])
+                    : nullptr;
+            if (item == nullptr || PyDict_SetItem(dict, key, item) != 0) {
+                Py_CLEAR(dict);
+            }
+            Py_XDECREF(key);
+            Py_XDECREF(item);
+        }
+        Py_LeaveRecursiveCall();
+        return dict;
+    }
+    default: {
+        PyObject *address = PyLong_FromVoidPtr(const_cast<NodeValue *>(&value));
+        if (address == nullptr) {
+            return nullptr;
+        }
+        PyObject *result = PyObject_CallFunctionObjArgs(to_python_fallback,
+                                                        node, address, nullptr);
+        Py_DECREF(address);
+        return result;
+    }
+    }
+}
+
+// The key tables of a Node, see _key in main.py.
+static bool node_keys(PyObject *node, PyObject **keys, PyObject **key_ids) {
+    *keys = PyObject_GetAttrString(node, "_keys");
+    *key_ids = *keys ? PyObject_GetAttrString(node, "_key_ids") : nullptr;
+    if (*key_ids == nullptr || !PyDict_Check(*keys) ||
+        !PyDict_Check(*key_ids)) {
+        Py_XDECREF(*keys);
+        Py_XDECREF(*key_ids);
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_TypeError, "Expected a Node.");
+        }
+        return false;
+    }
+    return true;
+}
+
+static PyObject *binding_setup(PyObject *, PyObject *args) {
+    PyObject *array, *object, *from_node, *to_node;
+    if (!PyArg_ParseTuple(args, "OOOO", &array, &object, &from_node,
+                          &to_node)) {
+        return nullptr;
+    }
+    Py_INCREF(array);
+    Py_INCREF(object);
+    Py_INCREF(from_node);
+    Py_INCREF(to_node);
+    Py_XSETREF(native_array, array);
+    Py_XSETREF(native_object, object);
+    Py_XSETREF(to_python_fallback, from_node);
+    Py_XSETREF(to_node_fallback, to_node);
+    Py_RETURN_NONE;
+}
+
+static PyObject *binding_to_python(PyObject *, PyObject *args) {
+    PyObject *node, *address;
+    if (!PyArg_ParseTuple(args, "OO", &node, &address)) {
+        return nullptr;
+    }
+    NodeValue *value = static_cast<NodeValue *>(PyLong_AsVoidPtr(address));
+    if (value == nullptr) {
+        if (PyErr_Occurred()) {
+            return nullptr;
+        }
+        Py_RETURN_NONE;
+    }
+    PyObject *keys, *key_ids;
+    if (!node_keys(node, &keys, &key_ids)) {
+        return nullptr;
+    }
+    PyObject *result = to_python(node, keys, key_ids, *value);
+    Py_DECREF(keys);
+    Py_DECREF(key_ids);
+    return result;
+}
+
+static PyObject *binding_to_node(PyObject *, PyObject *args) {
+    PyObject *node, *values;
+    if (!PyArg_ParseTuple(args, "OO", &node, &values)) {
+        return nullptr;
+    }
+    PyObject *items = PySequence_Fast(values, "Expected a sequence.");
+    if (items == nullptr) {
+        return nullptr;
+    }
+    PyObject *keys, *key_ids;
+    if (!node_keys(node, &keys, &key_ids)) {
+        Py_DECREF(items);
+        return nullptr;
+    }
+
+    Values *result = PyObject_New(Values, &ValuesType);
+    if (result != nullptr) {
+        result->tree = new Tree();
+        result->length = PySequence_Fast_GET_SIZE(items);
+        result->root = result->tree->values(result->length);
+        PyObject **item = PySequence_Fast_ITEMS(items);
+        for (Py_ssize_t i = 0; i < result->length; i++) {
+            if (!to_node(*result->tree, node, key_ids, item[i],
+                         &result->root[i])) {
+                Py_CLEAR(result);
+                break;
+            }
+        }
+    }
+    Py_DECREF(items);
+    Py_DECREF(keys);
+    Py_DECREF(key_ids);
+    return reinterpret_cast<PyObject *>(result);
+}
+
+static PyMethodDef methods[] = {
+    {"setup", binding_setup, METH_VARARGS,
+     "setup(native_array, native_object, to_python, to_node)\n"
+     "Sets the types built for arrays and objects and the converters of "
+     "every other value."},
+    {"to_python", binding_to_python, METH_VARARGS,
+     "to_python(node, address)\nConverts the NodeValue at `address`."},
+    {"to_node", binding_to_node, METH_VARARGS,
+     "to_node(node, values)\nConverts a sequence to a buffer of NodeValues."},
+    {nullptr, nullptr, 0, nullptr},
+};
+
+static PyModuleDef mod = {
+    PyModuleDef_HEAD_INIT, "pythonodejs._binding", nullptr, -1, methods,
+    nullptr,               nullptr,                nullptr, nullptr,
+};
+
+PyMODINIT_FUNC PyInit__binding(void) {
+    ValuesType.ob_base = values_type_head[0];
+    ValuesType.tp_name = "pythonodejs._binding.Values";
+    ValuesType.tp_basicsize = sizeof(Values);
+    ValuesType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ValuesType.tp_dealloc = reinterpret_cast<destructor>(Values_dealloc);
+    ValuesType.tp_as_buffer = &Values_as_buffer;
+    ValuesType.tp_doc = "NodeValues converted by to_node.";
+    if (PyType_Ready(&ValuesType) < 0) {
+        return nullptr;
+    }
+    return PyModule_Create(&mod);
+}